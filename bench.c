@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include "channels.h"
+
+/*
+ * Throughput and latency benchmark. Producers and consumers are spread
+ * round-robin over the channels; every message carries the CLOCK_MONOTONIC
+ * time it was sent at, so consumers can record how long the hand-over
+ * took. Prints messages per second and the p50/p99/p99.9 latency, or a
+ * CSV header and row with -C.
+ *
+ * use: ./bench [-p producers] [-c consumers] [-n channels] [-k capacity]
+ *              [-s payload bytes] [-m locked|spsc|mpmc]
+ *              [-t pointer|pool|value] [-N messages per producer] [-C]
+ */
+
+enum { TYPE_POINTER, TYPE_POOL, TYPE_VALUE };
+
+const char* MODES[] = {"locked", "spsc", "mpmc"};
+const char* TYPES[] = {"pointer", "pool", "value"};
+
+int producers = 1;
+int consumers = 1;
+int n_channels = 1;
+int capacity = 64;
+int payload = 16;
+int mode = CH_MODE_LOCKED;
+int type = TYPE_POINTER;
+long n_messages = 1000000;
+int csv = 0;
+
+int* channels;
+pthread_barrier_t start;
+
+struct consumer {
+    int channel;
+    long quota;
+    long* latency;
+};
+
+static long now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+void* producer(void* param) {
+    int channel = channels[(long) param % n_channels];
+    char value[CH_MAX_VALUE_SIZE];
+    char* m = value;
+    long stamp;
+    int err;
+
+    pthread_barrier_wait(&start);
+    for (long i = 0; i < n_messages; i++) {
+        if (type == TYPE_POINTER) m = malloc(payload);
+        else if (type == TYPE_POOL) m = ch_msg_alloc(channel);
+        if (m == NULL) { puts("Allocation error."); abort(); }
+        memset(m + sizeof(stamp), (int) i, payload - sizeof(stamp));
+        stamp = now();
+        memcpy(m, &stamp, sizeof(stamp));
+        if (type == TYPE_VALUE) err = ch_send_value(channel, m);
+        else err = ch_send(channel, m);
+        if (err) { puts("Send error."); abort(); }
+    }
+    return NULL;
+}
+
+void* consumer(void* param) {
+    struct consumer* c = param;
+    char value[CH_MAX_VALUE_SIZE];
+    void* m = value;
+    long stamp;
+    int err;
+
+    pthread_barrier_wait(&start);
+    for (long i = 0; i < c->quota; i++) {
+        if (type == TYPE_VALUE) err = ch_recv_value(c->channel, value);
+        else err = ch_recv(c->channel, &m);
+        if (err) { puts("Recv error."); abort(); }
+        memcpy(&stamp, m, sizeof(stamp));
+        c->latency[i] = now() - stamp;
+        if (type == TYPE_POINTER) free(m);
+        else if (type == TYPE_POOL) ch_msg_free(m);
+    }
+    return NULL;
+}
+
+static int by_value(const void* a, const void* b) {
+    long x = *(const long*) a, y = *(const long*) b;
+    return x < y ? -1 : x > y;
+}
+
+static int lookup_name(const char** names, int n, const char* name) {
+    for (int i = 0; i < n; i++) {
+        if (strcmp(names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+static void usage() {
+    puts("use: ./bench [-p producers] [-c consumers] [-n channels] [-k capacity]\n"
+         "             [-s payload bytes] [-m locked|spsc|mpmc]\n"
+         "             [-t pointer|pool|value] [-N messages per producer] [-C]");
+    exit(1);
+}
+
+static void parse(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:c:n:k:s:m:t:N:C")) != -1) {
+        switch (opt) {
+        case 'p': producers = atoi(optarg); break;
+        case 'c': consumers = atoi(optarg); break;
+        case 'n': n_channels = atoi(optarg); break;
+        case 'k': capacity = atoi(optarg); break;
+        case 's': payload = atoi(optarg); break;
+        case 'm': mode = lookup_name(MODES, 3, optarg); break;
+        case 't': type = lookup_name(TYPES, 3, optarg); break;
+        case 'N': n_messages = atol(optarg); break;
+        case 'C': csv = 1; break;
+        default: usage();
+        }
+    }
+    if (n_channels < 1 || producers < n_channels || consumers < n_channels) {
+        puts("every channel needs at least one producer and one consumer");
+        usage();
+    }
+    if (mode < 0 || type < 0 || n_messages < 1) usage();
+    if (mode == CH_MODE_SPSC && (producers != n_channels || consumers != n_channels)) {
+        puts("spsc channels take exactly one producer and one consumer each");
+        usage();
+    }
+    if (payload < (int) sizeof(long) || payload > CH_MAX_VALUE_SIZE) {
+        printf("payload must be between %d and %d bytes\n", (int) sizeof(long), CH_MAX_VALUE_SIZE);
+        usage();
+    }
+}
+
+int main(int argc, char** argv) {
+    pthread_t* threads;
+    struct consumer* cs;
+    long *all, total = 0, begin, end;
+    ch_attr attr;
+    int i, t = 0;
+
+    parse(argc, argv);
+    if (ch_setup() < 0) { puts("setup failed"); return 1; }
+
+    ch_attr_init(&attr);
+    attr.capacity = capacity;
+    attr.mode = mode;
+    if (type == TYPE_POOL) attr.msg_size = payload;
+    if (type == TYPE_VALUE) attr.value_size = payload;
+    channels = malloc(n_channels * sizeof(int));
+    for (i = 0; i < n_channels; i++) {
+        channels[i] = ch_open(CH_NEW, &attr);
+        if (channels[i] < 0) { puts("Open error."); return 1; }
+    }
+
+    // split what is sent on each channel among the consumers on it
+    cs = calloc(consumers, sizeof(struct consumer));
+    for (i = 0; i < consumers; i++) {
+        int c = i % n_channels;
+        long sent = n_messages * (producers / n_channels + (c < producers % n_channels));
+        int sharing = consumers / n_channels + (c < consumers % n_channels);
+        cs[i].channel = channels[c];
+        cs[i].quota = sent / sharing + (i / n_channels < sent % sharing);
+        cs[i].latency = malloc(cs[i].quota * sizeof(long));
+        if (cs[i].latency == NULL) { puts("Allocation error."); return 1; }
+    }
+
+    threads = malloc((producers + consumers) * sizeof(pthread_t));
+    pthread_barrier_init(&start, NULL, producers + consumers + 1);
+    for (i = 0; i < consumers; i++) {
+        if (pthread_create(&threads[t++], NULL, consumer, &cs[i])) { puts("Failed to create consumer."); abort(); }
+    }
+    for (i = 0; i < producers; i++) {
+        if (pthread_create(&threads[t++], NULL, producer, (void*) (long) i)) { puts("Failed to create producer."); abort(); }
+    }
+    pthread_barrier_wait(&start);
+    begin = now();
+    for (i = 0; i < t; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    end = now();
+
+    for (i = 0; i < consumers; i++) total += cs[i].quota;
+    all = malloc(total * sizeof(long));
+    for (i = 0, t = 0; i < consumers; i++) {
+        memcpy(all + t, cs[i].latency, cs[i].quota * sizeof(long));
+        t += cs[i].quota;
+    }
+    qsort(all, total, sizeof(long), by_value);
+
+    double seconds = (end - begin) / 1.0e9;
+    long p50 = all[(long) (0.50 * (total - 1))];
+    long p99 = all[(long) (0.99 * (total - 1))];
+    long p999 = all[(long) (0.999 * (total - 1))];
+    if (csv) {
+        puts("mode,type,producers,consumers,channels,capacity,payload,messages,seconds,msg_per_s,p50_ns,p99_ns,p999_ns");
+        printf("%s,%s,%d,%d,%d,%d,%d,%ld,%.6f,%.0f,%ld,%ld,%ld\n", MODES[mode], TYPES[type],
+               producers, consumers, n_channels, capacity, payload, total, seconds,
+               total / seconds, p50, p99, p999);
+    } else {
+        printf("%s/%s: %d producers, %d consumers, %d channels of capacity %d, %d byte payloads\n",
+               MODES[mode], TYPES[type], producers, consumers, n_channels, capacity, payload);
+        printf("%ld messages in %.3f s: %.0f msg/s\n", total, seconds, total / seconds);
+        printf("latency p50 %ld ns, p99 %ld ns, p99.9 %ld ns\n", p50, p99, p999);
+    }
+
+    for (i = 0; i < consumers; i++) free(cs[i].latency);
+    free(cs);
+    free(all);
+    free(threads);
+    free(channels);
+    ch_destroy();
+    return 0;
+}
@@ -1,209 +1,3137 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <netinet/in.h>
-#include <poll.h>
-#include <sys/ioctl.h>
-#include <semaphore.h>
+#include <arpa/inet.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "channels.h"
 
 // declare global variables
-#define PORT0 8000
-#define PORT1 8001
-#define PORT2 8002
-#define PORT3 8003
-#define PORT4 8004
-#define PORT5 8005
-#define PORT6 8006
-#define PORT7 8007
-#define CHANNELS 8
-#define POLL_SIZE 24
-
-
-int socket_fds[CHANNELS];
-int client_fds[CHANNELS];
-int new_fds[CHANNELS];
-struct sockaddr_in serv_addr[CHANNELS];
-struct sockaddr_in cli_addr[CHANNELS];
-int ports[CHANNELS] = {PORT0, PORT1, PORT2, PORT3, PORT4, PORT5, PORT6, PORT7};
-socklen_t clilen[CHANNELS];
-struct pollfd fds[POLL_SIZE];
-int isMessage[CHANNELS];
+#define CACHE_LINE 64
+#define CHUNK_BITS 8
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define CHUNKS (CH_MAX_CHANNELS / CHUNK_SIZE)
+#define POOL_SLAB 64
+#define SPIN_MIN 16
+#define SPIN_DEFAULT 256
+
+// build with -DCH_NO_STATS to leave the channel statistics out
+#ifdef CH_NO_STATS
+#define STATS 0
+#else
+#define STATS 1
+#endif
+#define POOL_BATCH 32
+#define HANDLER_BATCH 32
+#define HIGH_WATER_SAMPLE 64
+
+struct channel;
+
+/*
+ * Locking mechanisms. Locks and condition variables are bare futex words
+ * rather than pthread objects so that an idle channel only costs a few
+ * bytes for them. A lock word is 0 when free, 1 when held and 2 when held
+ * with threads waiting for it.
+ */
+struct cond {
+    unsigned int seq;
+    int waiters;
+};
+
+/*
+ * Watchers. A thread in ch_select links one watch_node per channel it
+ * selects on into that channel's list. Whenever a channel's state changes
+ * and its watch_count is non-zero, every watcher on the list has its seq
+ * bumped and is woken up.
+ */
+struct ch_waiter {
+    unsigned int seq;
+};
+
+struct watch_node {
+    struct ch_waiter* waiter;
+    struct watch_node* next;
+};
+
+/*
+ * Single-producer/single-consumer channels. head and tail run freely and
+ * are masked on access; each lives on its own cache line together with the
+ * side's cached copy of the other index, so the hot path only touches the
+ * other side's line when its cached copy says the ring is empty or full.
+ * A side that is about to park sets its waiting flag and sleeps on it;
+ * whoever wakes it, the other side or ch_close, clears the flag first, so
+ * no wake-up can be lost. Each slot of ring is stride bytes wide and holds
+ * a message of size bytes.
+ */
+struct spsc {
+    unsigned int tail __attribute__((aligned(CACHE_LINE)));
+    unsigned int head_cache;
+    unsigned int head __attribute__((aligned(CACHE_LINE)));
+    unsigned int tail_cache;
+    unsigned int recv_waiting __attribute__((aligned(CACHE_LINE)));
+    unsigned int send_waiting;
+    unsigned int mask;
+    int size;
+    int stride;
+    struct channel* ch;
+    char* ring;
+};
+
+/*
+ * Multi-producer/multi-consumer channels: a bounded queue where every
+ * cell carries a sequence number telling senders and receivers whose turn
+ * it is, so competing threads only contend on a compare-and-swap of
+ * enqueue_pos or dequeue_pos. Threads that find the queue empty or full
+ * register in recv_waiters/send_waiters and sleep on the matching
+ * generation counter, which the other side bumps before waking one of them.
+ * Cells are stride bytes apart; a value channel's cells keep the value in
+ * place of msg.
+ */
+struct mpmc_cell {
+    unsigned long seq;
+    void* msg;
+};
+
+struct mpmc {
+    unsigned long enqueue_pos __attribute__((aligned(CACHE_LINE)));
+    unsigned long dequeue_pos __attribute__((aligned(CACHE_LINE)));
+    int recv_waiters __attribute__((aligned(CACHE_LINE)));
+    unsigned int recv_gen;
+    int send_waiters;
+    unsigned int send_gen;
+    unsigned long mask;
+    int size;
+    int stride;
+    struct channel* ch;
+    char* cells;
+};
+
+/*
+ * Priority channels: a locked channel with one ring of capacity slots per
+ * priority level, stride bytes apart, in rings. Bit p of levels is set
+ * while level p holds messages, so the highest pending level is found
+ * with a single count-leading-zeros. head and tail run freely and are
+ * masked on access. Everything is guarded by the channel's lock.
+ */
+struct prio {
+    unsigned int levels;
+    unsigned int head[CH_PRIORITIES];
+    unsigned int tail[CH_PRIORITIES];
+    char* rings;
+};
+
+/*
+ * Broadcast channels: one ring of capacity message pointers that every
+ * subscription reads with a cursor of its own. refs[i] counts the
+ * subscriptions that have yet to pass the message in slot i; the one that
+ * brings it to 0 releases the message, and only then may a publisher reuse
+ * the slot. Subscriptions pass messages in order, so the oldest slot is
+ * always the first to come free. Publishers are serialized by the
+ * channel's lock, which also guards n_subs and subs; subscriptions read
+ * without taking it. Subscribers sleep on recv_seq, which every publish
+ * and ch_close bump, and publishers on send_seq, which every release and
+ * ch_close bump; either side only makes the wake-up call while someone
+ * waits. Each subscription's cursor sits on a cache line of its own.
+ */
+struct bcast_sub {
+    unsigned int cursor __attribute__((aligned(CACHE_LINE)));
+    int held;
+};
+
+struct bcast {
+    int* refs;
+    void** ring;
+    struct bcast_sub* subs[CH_MAX_SUBSCRIBERS];
+    unsigned int tail __attribute__((aligned(CACHE_LINE)));
+    int n_subs;
+    unsigned int recv_seq __attribute__((aligned(CACHE_LINE)));
+    int recv_waiters;
+    unsigned int send_seq __attribute__((aligned(CACHE_LINE)));
+    int send_waiters;
+    int live;
+};
+
+/*
+ * Rendezvous channels, opened with a capacity of 0, have no ring at all. A
+ * sender or receiver that finds no partner parks an rdv_wait on its own
+ * stack in the channel's queue for its side and sleeps on the record's
+ * state. The partner that comes along takes the oldest record, copies the
+ * message straight from or into the parked thread's buffer, then sets the
+ * state and wakes that one thread. The queues are guarded by the
+ * channel's lock; n is also read without it by ch_peek and ch_select.
+ */
+enum { RDV_WAITING, RDV_DONE, RDV_CLOSED };
+
+struct rdv_wait {
+    struct rdv_wait* next;
+    char* buf;
+    unsigned int state;
+};
+
+struct rdv_queue {
+    struct rdv_wait* head;
+    struct rdv_wait* tail;
+    int n;
+};
+
+struct rdv {
+    struct rdv_queue senders;
+    struct rdv_queue receivers;
+};
+
+/*
+ * Message pools. Every thread that allocates or frees messages of a pool
+ * gets its own pool_cache, and each block remembers the cache it was
+ * carved for. Allocation pops the thread's local list and frees of its own
+ * blocks push onto it, neither needing an atomic operation. Blocks of
+ * another thread are collected in out_head..out_tail and handed back
+ * POOL_BATCH at a time onto the owner's remote list, which the owner takes
+ * over in one exchange once its local list runs dry. Threads find their
+ * cache through my_pools, indexed by channel number like the channel
+ * table; gen tells a pool apart from an older one on the same channel.
+ * When a thread exits, its caches go on their pool's idle list, blocks
+ * and all, and the next thread to join the pool takes one over, so
+ * threads that come and go do not strand memory.
+ */
+struct pool_block {
+    struct pool_cache* owner;
+    struct pool_block* next;
+    char msg[] __attribute__((aligned(16)));
+};
+
+struct pool_slab {
+    struct pool_slab* next;
+    char blocks[] __attribute__((aligned(16)));
+};
+
+struct pool_cache {
+    struct pool_block* local;
+    struct pool_cache* out_owner;
+    struct pool_block* out_head;
+    struct pool_block* out_tail;
+    int out_n;
+    struct pool* pool;
+    struct pool_cache* next;
+    struct pool_cache* idle_next;
+    struct pool_block* remote __attribute__((aligned(CACHE_LINE)));
+};
+
+struct pool {
+    size_t size;
+    int channel;
+    unsigned long gen;
+    unsigned int lock;
+    struct pool_slab* slabs;
+    struct pool_cache* caches;
+    struct pool_cache* idle;
+};
+
+struct pool_ref {
+    unsigned long gen;
+    struct pool_cache* cache;
+};
+
+/*
+ * Channel statistics. The message counters live in struct channel, on
+ * each side's cache line; the wait histograms take up a block of their
+ * own, which is only allocated once a thread first has to wait on the
+ * channel, so idle channels cost nothing extra. Senders only write the
+ * first cache line of it and receivers only the second, all with relaxed
+ * atomics. Waits are timed from the moment a thread finds it cannot go on
+ * until it can, and counted in log2 buckets of nanoseconds.
+ */
+struct metrics {
+    unsigned long send_wait_ns __attribute__((aligned(CACHE_LINE)));
+    unsigned int send_waits[CH_STATS_BUCKETS];
+    unsigned long recv_wait_ns __attribute__((aligned(CACHE_LINE)));
+    unsigned int recv_waits[CH_STATS_BUCKETS];
+};
+
+/*
+ * Shared channels. The whole channel lives in a POSIX shared memory
+ * object that every process using it maps wherever mmap puts it: a struct
+ * shm, a ring of capacity message offsets and, from arena on, 2 * capacity
+ * blocks of msg_size bytes. The ring holds offsets from the start of the
+ * mapping instead of pointers, so messages are handed from process to
+ * process without being copied. lock and the conditions are used with
+ * process-shared futexes and guard everything below them, including the
+ * list of free blocks, which is threaded through their payloads. A
+ * block's header has the same layout as a pool block's, with SHM_BLOCK as
+ * its owner.
+ */
+#define SHM_READY 0x63686e31
+#define SHM_BLOCK ((struct pool_cache*) 1)
+
+struct shm_block {
+    struct pool_cache* owner;
+    unsigned long offset;
+    char msg[] __attribute__((aligned(16)));
+};
+
+struct shm {
+    unsigned int ready;
+    int users;
+    int capacity;
+    int msg_size;
+    int block_size;
+    size_t arena;
+    size_t size;
+    char name[256];
+    unsigned int lock __attribute__((aligned(CACHE_LINE)));
+    struct cond send_cond;
+    struct cond recv_cond;
+    struct cond free_cond;
+    int count;
+    int closed;
+    unsigned int head;
+    unsigned int tail;
+    unsigned long free_list;
+    unsigned long ring[];
+};
+
+/*
+ * The parts of a channel that only some channels use, kept aside so that
+ * an idle channel stays small: the spin state, the sockets, the
+ * watchers, the handler, the pool and the wait histograms. It is
+ * allocated when a channel is opened with the socket backend, a msg_size
+ * or a spin limit of its own, otherwise when a thread first waits on it,
+ * selects on it, asks for its ch_fd or gives it a handler, and freed when
+ * the channel is released. Once set, ch->ext stays put until then.
+ *
+ * With the socket backend messages go through the loopback connection
+ * write_fd -> read_fd, which senders write under write_lock and
+ * receivers read under read_lock. spins is how long a waiting thread
+ * currently spins before it parks, at most spin_limit rounds. pool is
+ * set if the channel was opened with a msg_size, metrics once a thread
+ * has waited on the channel, unless statistics are compiled out.
+ */
+struct channel_ext {
+    // set when the channel is opened
+    int spin_limit;
+    int write_fd;
+    int read_fd;
+    unsigned int write_lock;
+    unsigned int read_lock;
+    struct pool* pool;
+    // changed by the threads that wait on the channel
+    struct metrics* metrics;
+    int spins;
+    // changed under watch_lock
+    unsigned int watch_lock;
+    int event_fd;
+    int event_ready;
+    struct watch_node* watchers;
+    // set by ch_on_message, used by the executor
+    ch_handler handler;
+    void* handler_ctx;
+    int number;
+    int queued;
+    struct channel* ready_next;
+};
+
+/*
+ * Per-channel state. With the memory backend messages are handed over
+ * through a ring of capacity slots and no sockets are created at all; a
+ * channel of capacity 1 uses slot as its ring, and one of capacity 0
+ * has an rdv instead. count only changes under lock, but ch_peek and
+ * ch_select read it without, so it is accessed atomically. Messages are
+ * size bytes, a pointer unless value_size is set, and ring slots are
+ * stride bytes apart. watch_count is how many selectors, eventfds and
+ * handlers want to hear of changes; while it is 0 notify_watchers does
+ * not look at ext. sent, high_water and received count messages for
+ * ch_stats. closed is set by ch_close, under lock; senders look at it on
+ * every send and receivers only once the channel runs empty.
+ *
+ * Channels sit next to each other in chunks that start on a cache line,
+ * but are not padded out to lines of their own: both sides of a locked
+ * channel write its lock, count and conditions on every message anyway,
+ * so keeping senders' and receivers' fields apart would only cost
+ * memory. The lock-free modes, whose two sides share no lock, keep their
+ * hot fields in struct spsc and struct mpmc, with a line for each side.
+ * What a message needs, the locked queue with its conditions and slot
+ * and the counters, takes 112 bytes, so a channel does not fit in one
+ * line even with everything else in struct channel_ext.
+ */
+struct channel {
+    // set when the channel is opened
+    int open;
+    int mode;
+    int capacity;
+    int value_size;
+    int size;
+    int stride;
+    int watch_count;
+    union {
+        void** ring;
+        struct spsc* spsc;
+        struct mpmc* mpmc;
+        struct prio* prio;
+        struct bcast* bcast;
+        struct rdv* rdv;
+        struct shm* shm;
+    };
+    struct channel_ext* ext;
+    // changed by both sides, mostly under lock
+    unsigned int lock;
+    int count;
+    unsigned int head;
+    unsigned int tail;
+    struct cond send_cond;
+    struct cond recv_cond;
+    void* slot;
+    int closed;
+    int high_water;
+    unsigned long sent;
+    unsigned long received;
+};
+
+/*
+ * The channel table. Channel numbers index straight into chunks of
+ * CHUNK_SIZE channels, which are allocated the first time a channel in
+ * them is opened and never move, so looking a channel up takes no lock.
+ * Opening and closing channels is serialized by table_lock. Closed
+ * channel numbers are kept on free_ids for reuse.
+ */
+struct channel* chunks[CHUNKS];
+unsigned int table_lock;
+int next_id;
+int* free_ids;
+int n_free;
+int free_size;
+
+int backend;
+int setup_done;
+int spin_default;
 
 int on = 1;
-int n;
 
+unsigned long pool_gen;
+static __thread struct pool_ref** my_pools;
+
+/*
+ * The executor. A channel with a message handler is queued on the ready
+ * list whenever its state changes, unless it is queued already, and the
+ * executor threads sleep on ready_cond until there is one to take, so
+ * only channels with something to do cost anything.
+ */
+unsigned int ready_lock;
+struct cond ready_cond;
+struct channel* ready_head;
+struct channel* ready_tail;
+pthread_t* executors;
+int n_executors;
+int executors_stopping;
+
+
+/*
+ * Futexes.
+ */
+
+/*
+ * The _as versions take FUTEX_PRIVATE_FLAG for futex words only this
+ * process uses, or 0 for ones in memory shared with other processes.
+ */
+static void futex_wait_as(unsigned int* addr, unsigned int val,
+                          const struct timespec* deadline, int private) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_BITSET | private, val, deadline, NULL,
+            FUTEX_BITSET_MATCH_ANY);
+}
+
+static void futex_wake_as(unsigned int* addr, int count, int private) {
+    syscall(SYS_futex, addr, FUTEX_WAKE | private, count, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned int* addr, int count) {
+    futex_wake_as(addr, count, FUTEX_PRIVATE_FLAG);
+}
+
+/*
+ * Sleeps while *addr is val, but gives up at deadline, an absolute
+ * CLOCK_MONOTONIC time. A NULL deadline waits forever.
+ */
+static void futex_wait_until(unsigned int* addr, unsigned int val,
+                             const struct timespec* deadline) {
+    futex_wait_as(addr, val, deadline, FUTEX_PRIVATE_FLAG);
+}
+
+/*
+ * Deadlines. Every operation that can wait takes a deadline: NULL to wait
+ * for as long as it takes, &no_wait to not wait at all, or an absolute
+ * CLOCK_MONOTONIC time.
+ */
+
+static const struct timespec no_wait = {0, 0};
+
+static void deadline_in(struct timespec* deadline, int timeout) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (timeout % 1000) * 1000000L;
+    if(deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static int expired(const struct timespec* deadline) {
+    struct timespec now;
+    if(deadline == NULL) {
+        return 0;
+    }
+    if(deadline == &no_wait) {
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec ||
+           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/*
+ * Locks and condition variables.
+ */
+
+static void lock_as(unsigned int* l, int private) {
+    unsigned int c = 0;
+    if(__atomic_compare_exchange_n(l, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if(c != 2) {
+        c = __atomic_exchange_n(l, 2, __ATOMIC_ACQUIRE);
+    }
+    while(c != 0) {
+        futex_wait_as(l, 2, NULL, private);
+        c = __atomic_exchange_n(l, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void unlock_as(unsigned int* l, int private) {
+    if(__atomic_exchange_n(l, 0, __ATOMIC_RELEASE) == 2) {
+        futex_wake_as(l, 1, private);
+    }
+}
+
+static void lock(unsigned int* l) {
+    lock_as(l, FUTEX_PRIVATE_FLAG);
+}
+
+static void unlock(unsigned int* l) {
+    unlock_as(l, FUTEX_PRIVATE_FLAG);
+}
+
+/*
+ * Must be called with l held, and signalers must hold l too.
+ * returns < 0 without waiting if the deadline has already passed.
+ */
+static int cond_wait_as(struct cond* c, unsigned int* l, const struct timespec* deadline,
+                        int private) {
+    unsigned int seq;
+    if(expired(deadline)) {
+        return -1;
+    }
+    seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->waiters, 1, __ATOMIC_RELAXED);
+    unlock_as(l, private);
+    futex_wait_as(&c->seq, seq, deadline, private);
+    lock_as(l, private);
+    __atomic_sub_fetch(&c->waiters, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void cond_signal_as(struct cond* c, int count, int private) {
+    if(__atomic_load_n(&c->waiters, __ATOMIC_RELAXED) > 0) {
+        __atomic_add_fetch(&c->seq, 1, __ATOMIC_RELEASE);
+        futex_wake_as(&c->seq, count, private);
+    }
+}
+
+static int cond_wait(struct cond* c, unsigned int* l, const struct timespec* deadline) {
+    return cond_wait_as(c, l, deadline, FUTEX_PRIVATE_FLAG);
+}
+
+static void cond_signal(struct cond* c, int count) {
+    cond_signal_as(c, count, FUTEX_PRIVATE_FLAG);
+}
+
+/*
+ * Side state.
+ */
+
+/*
+ * Returns the channel's struct channel_ext, allocating it the first time,
+ * or NULL if that fails.
+ */
+static struct channel_ext* ext_of(struct channel* ch) {
+    struct channel_ext* ext = __atomic_load_n(&ch->ext, __ATOMIC_ACQUIRE);
+    struct channel_ext* none = NULL;
+    if(ext != NULL) {
+        return ext;
+    }
+    ext = calloc(1, sizeof(*ext));
+    if(ext == NULL) {
+        return NULL;
+    }
+    ext->spin_limit = spin_default;
+    ext->spins = spin_default < SPIN_MIN ? spin_default : SPIN_MIN;
+    ext->write_fd = -1;
+    ext->read_fd = -1;
+    ext->event_fd = -1;
+    // another thread may have beaten us to it
+    if(!__atomic_compare_exchange_n(&ch->ext, &none, ext, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(ext);
+        ext = none;
+    }
+    return ext;
+}
+
+/*
+ * Spinning. A thread about to park first spins for a while with pause
+ * instructions and then yields once, since the other side is often just
+ * about to make its move and a futex round trip costs far more than the
+ * wait itself. How long to spin is learned per channel: a wait that ends
+ * while spinning pulls ext->spins towards twice the rounds it took, any
+ * other wait halves the distance to SPIN_MIN, so channels whose waits are
+ * long soon stop burning CPU. Use as
+ *
+ *     spin_start(&sp, ch);
+ *     while(!ready && spin_more(&sp)) ...
+ *     spin_end(&sp, ready);
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+struct spin {
+    struct channel_ext* ext;
+    int budget;
+    int rounds;
+};
+
+static void spin_start(struct spin* sp, struct channel* ch) {
+    // a channel without an ext has the default limit, which is none on
+    // one CPU
+    sp->ext = spin_default > 0 ? ext_of(ch) : __atomic_load_n(&ch->ext, __ATOMIC_ACQUIRE);
+    sp->budget = sp->ext != NULL && sp->ext->spin_limit > 0 ?
+        __atomic_load_n(&sp->ext->spins, __ATOMIC_RELAXED) : -1;
+    sp->rounds = 0;
+}
+
+static int spin_more(struct spin* sp) {
+    if(sp->rounds < sp->budget) {
+        cpu_relax();
+    } else if(sp->rounds == sp->budget) {
+        sched_yield();
+    } else {
+        return 0;
+    }
+    sp->rounds++;
+    return 1;
+}
+
+static void spin_end(struct spin* sp, int ready) {
+    int spins = sp->budget;
+    if(spins < 0) {
+        return;
+    }
+    if(ready && sp->rounds <= sp->budget) {
+        spins += (2 * sp->rounds - spins) / 8;
+    } else {
+        // spinning did not help, even if yielding did
+        spins -= (spins - SPIN_MIN) / 2;
+    }
+    if(spins < SPIN_MIN) {
+        spins = SPIN_MIN;
+    }
+    if(spins > sp->ext->spin_limit) {
+        spins = sp->ext->spin_limit;
+    }
+    if(spins != sp->budget) {
+        __atomic_store_n(&sp->ext->spins, spins, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Statistics.
+ */
+
+enum { SEND_SIDE, RECV_SIDE };
+
+/*
+ * Returns the channel's wait histograms, allocating them the first time,
+ * or NULL if that fails.
+ */
+static struct metrics* metrics_of(struct channel* ch) {
+    struct channel_ext* ext = ext_of(ch);
+    struct metrics* m;
+    struct metrics* none = NULL;
+    if(ext == NULL) {
+        return NULL;
+    }
+    m = __atomic_load_n(&ext->metrics, __ATOMIC_ACQUIRE);
+    if(m != NULL) {
+        return m;
+    }
+    if(posix_memalign((void**) &m, CACHE_LINE, sizeof(*m)) != 0) {
+        return NULL;
+    }
+    bzero(m, sizeof(*m));
+    // another waiter may have beaten us to it
+    if(!__atomic_compare_exchange_n(&ext->metrics, &none, m, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(m);
+        m = none;
+    }
+    return m;
+}
+
+/*
+ * Returns when the current wait began: began if it already has, otherwise
+ * now, or 0 if nothing is timed because the caller will not wait at all.
+ */
+static long wait_mark(long began, const struct timespec* deadline) {
+    struct timespec now;
+    if(!STATS || began != 0 || deadline == &no_wait) {
+        return began;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void wait_done(struct channel* ch, int side, long began) {
+    struct metrics* m;
+    struct timespec now;
+    unsigned long took;
+    int bucket;
+    if(!STATS || began == 0 || (m = metrics_of(ch)) == NULL) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    took = now.tv_sec * 1000000000L + now.tv_nsec - began;
+    bucket = took > 1 ? 63 - __builtin_clzl(took) : 0;
+    if(bucket >= CH_STATS_BUCKETS) {
+        bucket = CH_STATS_BUCKETS - 1;
+    }
+    if(side == SEND_SIDE) {
+        __atomic_add_fetch(&m->send_wait_ns, took, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&m->send_waits[bucket], 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&m->recv_wait_ns, took, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&m->recv_waits[bucket], 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Number of messages in the channel right now. Only exact while no-one
+ * is sending or receiving.
+ */
+static int depth(struct channel* ch) {
+    long d;
+    switch(ch->mode) {
+    case CH_MODE_SPSC:
+        d = (int) (__atomic_load_n(&ch->spsc->tail, __ATOMIC_RELAXED) -
+                   __atomic_load_n(&ch->spsc->head, __ATOMIC_RELAXED));
+        break;
+    case CH_MODE_MPMC:
+        d = (long) (__atomic_load_n(&ch->mpmc->enqueue_pos, __ATOMIC_RELAXED) -
+                    __atomic_load_n(&ch->mpmc->dequeue_pos, __ATOMIC_RELAXED));
+        break;
+    case CH_MODE_SHARED:
+        d = __atomic_load_n(&ch->shm->count, __ATOMIC_RELAXED);
+        break;
+    case CH_MODE_BROADCAST:
+        d = __atomic_load_n(&ch->bcast->live, __ATOMIC_RELAXED);
+        break;
+    default:
+        d = __atomic_load_n(&ch->count, __ATOMIC_RELAXED);
+        break;
+    }
+    return d < 0 ? 0 : d > ch->capacity ? ch->capacity : d;
+}
+
+/*
+ * Number of messages in the channel after a send of n messages that
+ * brought the channel's total to sent, as far as the sender can tell
+ * without touching the receivers' cache lines. An SPSC sender counts from
+ * its cached copy of head, which may lag behind and so overstate the
+ * depth; MPMC senders keep no such copy and only look at dequeue_pos
+ * once every HIGH_WATER_SAMPLE messages. returns -1 if the sender cannot
+ * tell this time.
+ */
+static int sent_depth(struct channel* ch, unsigned long sent, int n) {
+    struct spsc* q;
+    switch(ch->mode) {
+    case CH_MODE_SPSC:
+        q = ch->spsc;
+        return (int) (__atomic_load_n(&q->tail, __ATOMIC_RELAXED) - q->head_cache);
+    case CH_MODE_MPMC:
+        if((sent - n) / HIGH_WATER_SAMPLE == sent / HIGH_WATER_SAMPLE) {
+            return -1;
+        }
+        return depth(ch);
+    default:
+        // the count sits on a line the senders write anyway
+        return depth(ch);
+    }
+}
+
+static void count_sent(struct channel* ch, int n) {
+    unsigned long sent;
+    int d, high;
+    if(!STATS || n <= 0) {
+        return;
+    }
+    sent = __atomic_add_fetch(&ch->sent, n, __ATOMIC_RELAXED);
+    d = sent_depth(ch, sent, n);
+    high = __atomic_load_n(&ch->high_water, __ATOMIC_RELAXED);
+    while(d > high && !__atomic_compare_exchange_n(&ch->high_water, &high, d, 1,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void count_received(struct channel* ch, int n) {
+    if(!STATS || n <= 0) {
+        return;
+    }
+    __atomic_add_fetch(&ch->received, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Watchers.
+ */
+
+/*
+ * The handshakes between a thread that changes a channel and one that waits
+ * for the change: the waiter registers with a sequentially consistent
+ * read-modify-write of a counter and then looks at the channel, the changer
+ * changes it and then looks at the counter, so either the waiter sees the
+ * change or the changer sees the waiter. Both sides need a full fence
+ * between their store and their load. ThreadSanitizer does not understand
+ * fences, so under it the changer does a seq_cst read-modify-write of the
+ * counter instead, which either comes after the waiter's and sees it or
+ * comes before and synchronizes with it, and the waiter's own increment
+ * already does what its fence would.
+ */
+#if defined(__SANITIZE_THREAD__)
+#define fence_before_load(counter) ((void) __atomic_fetch_add(counter, 0, __ATOMIC_SEQ_CST))
+#define fence_after_register() ((void) 0)
+#else
+#define fence_before_load(counter) __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define fence_after_register() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/*
+ * Queues a channel with a handler for the executor. The queued flag keeps
+ * it on the ready list at most once; the executor clears it when it is
+ * done with the channel.
+ */
+static void queue_ready(struct channel* ch) {
+    struct channel_ext* ext = ch->ext;
+    if(__atomic_load_n(&ext->queued, __ATOMIC_RELAXED) ||
+       __atomic_exchange_n(&ext->queued, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    lock(&ready_lock);
+    ext->ready_next = NULL;
+    if(ready_tail == NULL) {
+        ready_head = ch;
+    } else {
+        ready_tail->ext->ready_next = ch;
+    }
+    ready_tail = ch;
+    cond_signal(&ready_cond, 1);
+    unlock(&ready_lock);
+}
+
+static int pending(struct channel* ch);
+static int ch_closed(struct channel* ch);
+
+/*
+ * Makes the channel's eventfd readable if a receive would not block and
+ * drains it otherwise. Called with watch_lock held after every change, so
+ * the last call sees the channel as it ended up.
+ */
+static void sync_event_fd(struct channel* ch) {
+    struct channel_ext* ext = ch->ext;
+    uint64_t count = 1;
+    int ready = pending(ch) || ch_closed(ch);
+    if(ready == ext->event_ready) {
+        return;
+    }
+    if(ready && write(ext->event_fd, &count, sizeof(count)) < 0) {
+        printf("error signalling eventfd: %s\n", strerror(errno));
+    } else if(!ready && read(ext->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        printf("error draining eventfd: %s\n", strerror(errno));
+    }
+    ext->event_ready = ready;
+}
+
+static void notify_watchers(struct channel* ch) {
+    struct channel_ext* ext;
+    struct watch_node* node;
+    // pairs with the fence in ch_select: either it sees our change or we
+    // see its registration, which comes after it set up ch->ext
+    fence_before_load(&ch->watch_count);
+    if(__atomic_load_n(&ch->watch_count, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+    ext = __atomic_load_n(&ch->ext, __ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&ext->handler, __ATOMIC_RELAXED) != NULL) {
+        queue_ready(ch);
+    }
+    lock(&ext->watch_lock);
+    for(node = ext->watchers; node != NULL; node = node->next) {
+        __atomic_add_fetch(&node->waiter->seq, 1, __ATOMIC_RELEASE);
+        futex_wake(&node->waiter->seq, 1);
+    }
+    if(ext->event_fd >= 0) {
+        sync_event_fd(ch);
+    }
+    unlock(&ext->watch_lock);
+}
+
+/*
+ * Called once ext_of(ch) has succeeded.
+ */
+static void watch(struct channel* ch, struct watch_node* node) {
+    struct channel_ext* ext = ch->ext;
+    lock(&ext->watch_lock);
+    node->next = ext->watchers;
+    ext->watchers = node;
+    __atomic_add_fetch(&ch->watch_count, 1, __ATOMIC_SEQ_CST);
+    unlock(&ext->watch_lock);
+}
+
+static void unwatch(struct channel* ch, struct watch_node* node) {
+    struct channel_ext* ext = ch->ext;
+    struct watch_node** p;
+    lock(&ext->watch_lock);
+    for(p = &ext->watchers; *p != NULL; p = &(*p)->next) {
+        if(*p == node) {
+            *p = node->next;
+            break;
+        }
+    }
+    __atomic_sub_fetch(&ch->watch_count, 1, __ATOMIC_RELAXED);
+    unlock(&ext->watch_lock);
+}
+
+/*
+ * Channel lookup.
+ */
+
+static struct channel* lookup(int channel) {
+    struct channel* chunk;
+    struct channel* ch;
+    if(channel < 0 || channel >= CH_MAX_CHANNELS) {
+        return NULL;
+    }
+    chunk = __atomic_load_n(&chunks[channel >> CHUNK_BITS], __ATOMIC_ACQUIRE);
+    if(chunk == NULL) {
+        return NULL;
+    }
+    ch = &chunk[channel & (CHUNK_SIZE - 1)];
+    if(!__atomic_load_n(&ch->open, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return ch;
+}
+
+/*
+ * Socket backend. Each channel gets its own loopback connection on an
+ * ephemeral port; the listening socket is only needed until the
+ * connection has been accepted.
+ */
+
+static int open_socket(struct channel_ext* ext, int channel) {
+    struct sockaddr_in serv_addr;
+    socklen_t len = sizeof(serv_addr);
+    int listen_fd;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listen_fd < 0) {
+        printf("error opening server socket %d\n", channel);
+        return -1;
+    }
+    ext->read_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(ext->read_fd < 0) {
+        printf("error opening client socket %d\n", channel);
+        close(listen_fd);
+        return -1;
+    }
+
+    // set socket to be reusable
+    if(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on)) < 0) {
+        printf("error on setting socket %d to reusable\n", channel);
+        goto fail;
+    }
+
+    bzero((char *) &serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    serv_addr.sin_port = 0;
+    if(bind(listen_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        printf("error on binding channel %d\n", channel);
+        goto fail;
+    }
+    if(listen(listen_fd, 1) < 0 ||
+       getsockname(listen_fd, (struct sockaddr *) &serv_addr, &len) < 0) {
+        printf("error listening on channel %d\n", channel);
+        goto fail;
+    }
+    if(connect(ext->read_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        printf("error connecting %d\n", channel);
+        goto fail;
+    }
+    ext->write_fd = accept(listen_fd, NULL, NULL);
+    if(ext->write_fd < 0) {
+        printf("error accepting on %d\n", channel);
+        goto fail;
+    }
+    close(listen_fd);
+    return 0;
+
+fail:
+    close(listen_fd);
+    close(ext->read_fd);
+    ext->read_fd = -1;
+    return -1;
+}
+
+/*
+ * Set up.
+ */
+
+int ch_setup() {
+    return ch_setup_backend(CH_BACKEND_MEMORY);
+}
+
+int ch_setup_backend(int which) {
+	// must be called exactly once before using any channels
+	// how is it not safe to use library? think of scenarios
+	// return 0 on success or < 0 on error
+
+    // if this was called previously, then setup_done would be set
+    if(setup_done) {
+        printf("set up has been called previously\n");
+        return -1;
+    }
+    int i;
+    if(which != CH_BACKEND_MEMORY && which != CH_BACKEND_SOCKET) {
+        printf("unknown channel backend %d\n", which);
+        return -1;
+    }
+    backend = which;
+    // spinning only pays off if the other side can run meanwhile
+    spin_default = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_DEFAULT : 0;
+    bzero(chunks, sizeof(chunks));
+    table_lock = 0;
+    next_id = 0;
+    n_free = 0;
+    setup_done = 1;
+
+    // the default channels start out empty with a capacity of one message
+    for(i = 0; i < CH_DEFAULT_CHANNELS; i++) {
+        if(ch_open(i, NULL) < 0) {
+            ch_destroy();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Channel queues.
+ */
+
+/*
+ * A pointer channel moves the void* it is given; a value channel copies
+ * value_size bytes into a slot rounded up to whole cache lines, so that
+ * neighbouring slots in use by a sender and a receiver do not share one.
+ */
+static int msg_size(int value_size) {
+    return value_size > 0 ? value_size : (int) sizeof(void*);
+}
+
+static int slot_stride(int value_size) {
+    return value_size > 0 ? (value_size + CACHE_LINE - 1) & ~(CACHE_LINE - 1)
+                          : (int) sizeof(void*);
+}
+
+static inline void copy_msg(char* to, const char* from, int size) {
+    if(size == sizeof(void*)) {
+        memcpy(to, from, sizeof(void*));
+    } else {
+        memcpy(to, from, size);
+    }
+}
+
+static struct spsc* spsc_create(struct channel* ch, int capacity, int value_size);
+static void spsc_free(struct spsc* q);
+static int spsc_pending(struct spsc* q);
+static struct mpmc* mpmc_create(struct channel* ch, int capacity, int value_size);
+static void mpmc_free(struct mpmc* q);
+static int mpmc_pending(struct mpmc* q);
+static void prio_free(struct prio* q);
+static void bcast_free(struct bcast* q);
+static void pool_free(struct pool* p);
+static void shm_detach(struct shm* r);
+
+static void free_queue(struct channel* ch) {
+    switch(ch->mode) {
+    case CH_MODE_SPSC:
+        spsc_free(ch->spsc);
+        break;
+    case CH_MODE_MPMC:
+        mpmc_free(ch->mpmc);
+        break;
+    case CH_MODE_PRIORITY:
+        prio_free(ch->prio);
+        break;
+    case CH_MODE_BROADCAST:
+        bcast_free(ch->bcast);
+        break;
+    case CH_MODE_SHARED:
+        shm_detach(ch->shm);
+        break;
+    default:
+        if(ch->ring != &ch->slot) {
+            free(ch->ring);
+        }
+        break;
+    }
+    ch->ring = NULL;
+}
+
+/*
+ * Closes the channel's sockets and eventfd, if it has them, and frees its
+ * ext with the pool and histograms in it.
+ */
+static void free_ext(struct channel* ch) {
+    struct channel_ext* ext = ch->ext;
+    if(ext == NULL) {
+        return;
+    }
+    if(ext->write_fd >= 0) {
+        close(ext->write_fd);
+    }
+    if(ext->read_fd >= 0) {
+        close(ext->read_fd);
+    }
+    if(ext->event_fd >= 0) {
+        close(ext->event_fd);
+    }
+    pool_free(ext->pool);
+    free(ext->metrics);
+    free(ext);
+    ch->ext = NULL;
+}
+
+static int pending(struct channel* ch) {
+    switch(ch->mode) {
+    case CH_MODE_SPSC:
+        return spsc_pending(ch->spsc);
+    case CH_MODE_MPMC:
+        return mpmc_pending(ch->mpmc);
+    case CH_MODE_SHARED:
+        return __atomic_load_n(&ch->shm->count, __ATOMIC_ACQUIRE) > 0;
+    case CH_MODE_BROADCAST:
+        return __atomic_load_n(&ch->bcast->live, __ATOMIC_ACQUIRE) > 0;
+    default:
+        if(ch->capacity == 0) {
+            return __atomic_load_n(&ch->rdv->senders.n, __ATOMIC_ACQUIRE) > 0;
+        }
+        return __atomic_load_n(&ch->count, __ATOMIC_ACQUIRE) > 0;
+    }
+}
+
+static int ch_closed(struct channel* ch) {
+    if(ch->mode == CH_MODE_SHARED) {
+        return __atomic_load_n(&ch->shm->closed, __ATOMIC_SEQ_CST);
+    }
+    return __atomic_load_n(&ch->closed, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Destroy.
+ */
+
+int ch_destroy() {
+	// clean up before closing program
+	// after calling this, not safe to use any channels functions
+	// return 0 on success or < 0 on error
+	// was ch_setup called earlier?
+	// is no one currently listening on any channels?
+    int i, j;
+    if(!setup_done) {
+        printf("set up has not been called\n");
+        return -1;
+    }
+    if(n_executors > 0) {
+        ch_executor_stop();
+    }
+    ready_head = NULL;
+    ready_tail = NULL;
+    setup_done = 0;
+    for(i = 0; i < CHUNKS; i++) {
+        if(chunks[i] == NULL) {
+            continue;
+        }
+        for(j = 0; j < CHUNK_SIZE; j++) {
+            if(chunks[i][j].open) {
+                free_queue(&chunks[i][j]);
+                free_ext(&chunks[i][j]);
+            }
+        }
+        free(chunks[i]);
+        chunks[i] = NULL;
+    }
+    free(free_ids);
+    free_ids = NULL;
+    free_size = 0;
+    n_free = 0;
+    return 0;
+}
+
+/*
+ * Single-producer/single-consumer channels.
+ */
+
+static struct spsc* spsc_create(struct channel* ch, int capacity, int value_size) {
+    struct spsc* q;
+    if(posix_memalign((void**) &q, CACHE_LINE, sizeof(*q)) != 0) {
+        return NULL;
+    }
+    bzero(q, sizeof(*q));
+    q->mask = capacity - 1;
+    q->size = msg_size(value_size);
+    q->stride = slot_stride(value_size);
+    q->ch = ch;
+    if(posix_memalign((void**) &q->ring, CACHE_LINE, (size_t) capacity * q->stride) != 0) {
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+static void spsc_free(struct spsc* q) {
+    if(q != NULL) {
+        free(q->ring);
+        free(q);
+    }
+}
+
+static int spsc_pending(struct spsc* q) {
+    return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) !=
+           __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+}
+
+static int spsc_room(struct spsc* q) {
+    return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) <= q->mask;
+}
+
+/*
+ * Sends up to n messages, publishing every run of messages that fits with
+ * a single store of tail. Returns how many were sent, which is n unless
+ * the deadline passed while the ring was full.
+ */
+static int spsc_send_many(struct spsc* q, const char* msgs, int n,
+                          const struct timespec* deadline) {
+    unsigned int tail = q->tail;
+    struct spin sp;
+    long began = 0;
+    int sent = 0;
+    while(sent < n) {
+        if(tail - q->head_cache > q->mask) {
+            q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        }
+        if(tail - q->head_cache > q->mask && deadline != &no_wait) {
+            began = wait_mark(began, deadline);
+            spin_start(&sp, q->ch);
+            while(spin_more(&sp)) {
+                q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+                if(tail - q->head_cache <= q->mask) {
+                    break;
+                }
+            }
+            spin_end(&sp, tail - q->head_cache <= q->mask);
+        }
+        while(tail - q->head_cache > q->mask) {
+            if(expired(deadline) || ch_closed(q->ch)) {
+                wait_done(q->ch, SEND_SIDE, began);
+                return sent;
+            }
+            // announce that we are about to park, then look again so a
+            // receiver that freed a slot in between cannot be missed
+            __atomic_store_n(&q->send_waiting, 1, __ATOMIC_SEQ_CST);
+            q->head_cache = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+            if(tail - q->head_cache > q->mask && !ch_closed(q->ch)) {
+                futex_wait_until(&q->send_waiting, 1, deadline);
+                q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+            }
+            __atomic_store_n(&q->send_waiting, 0, __ATOMIC_RELAXED);
+        }
+        while(sent < n && tail - q->head_cache <= q->mask) {
+            copy_msg(q->ring + (tail & q->mask) * q->stride, msgs + sent * q->size, q->size);
+            tail++;
+            sent++;
+        }
+        __atomic_store_n(&q->tail, tail, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&q->recv_waiting, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&q->recv_waiting, 0, __ATOMIC_RELAXED);
+            futex_wake(&q->recv_waiting, 1);
+        }
+        notify_watchers(q->ch);
+    }
+    wait_done(q->ch, SEND_SIDE, began);
+    return sent;
+}
+
+/*
+ * Receives between 1 and max messages, or returns 0 if the deadline passed
+ * while the ring was empty.
+ */
+static int spsc_recv_many(struct spsc* q, char* dest, int max,
+                          const struct timespec* deadline) {
+    unsigned int head = q->head;
+    struct spin sp;
+    long began = 0;
+    int got = 0;
+    if(head == q->tail_cache) {
+        q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    }
+    if(head == q->tail_cache && deadline != &no_wait) {
+        began = wait_mark(began, deadline);
+        spin_start(&sp, q->ch);
+        while(spin_more(&sp)) {
+            q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+            if(head != q->tail_cache) {
+                break;
+            }
+        }
+        spin_end(&sp, head != q->tail_cache);
+    }
+    while(head == q->tail_cache) {
+        if(ch_closed(q->ch)) {
+            // whatever was sent before the close is visible by now
+            q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+            if(head != q->tail_cache) {
+                break;
+            }
+        }
+        if(expired(deadline) || ch_closed(q->ch)) {
+            wait_done(q->ch, RECV_SIDE, began);
+            return 0;
+        }
+        __atomic_store_n(&q->recv_waiting, 1, __ATOMIC_SEQ_CST);
+        q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+        if(head == q->tail_cache && !ch_closed(q->ch)) {
+            futex_wait_until(&q->recv_waiting, 1, deadline);
+            q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        }
+        __atomic_store_n(&q->recv_waiting, 0, __ATOMIC_RELAXED);
+    }
+    wait_done(q->ch, RECV_SIDE, began);
+    while(got < max && head != q->tail_cache) {
+        copy_msg(dest + got * q->size, q->ring + (head & q->mask) * q->stride, q->size);
+        head++;
+        got++;
+    }
+    __atomic_store_n(&q->head, head, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&q->send_waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&q->send_waiting, 0, __ATOMIC_RELAXED);
+        futex_wake(&q->send_waiting, 1);
+    }
+    notify_watchers(q->ch);
+    return got;
+}
+
+/*
+ * Wakes both sides after the channel was marked closed. They see it as
+ * soon as they look again, since the flags they sleep on change.
+ */
+static void spsc_close(struct spsc* q) {
+    __atomic_store_n(&q->send_waiting, 0, __ATOMIC_SEQ_CST);
+    futex_wake(&q->send_waiting, 1);
+    __atomic_store_n(&q->recv_waiting, 0, __ATOMIC_SEQ_CST);
+    futex_wake(&q->recv_waiting, 1);
+}
+
+/*
+ * Multi-producer/multi-consumer channels.
+ */
+
+static struct mpmc* mpmc_create(struct channel* ch, int capacity, int value_size) {
+    struct mpmc* q;
+    struct mpmc_cell* cell;
+    unsigned long i;
+    if(posix_memalign((void**) &q, CACHE_LINE, sizeof(*q)) != 0) {
+        return NULL;
+    }
+    bzero(q, sizeof(*q));
+    q->mask = capacity - 1;
+    q->size = msg_size(value_size);
+    q->stride = value_size > 0 ? slot_stride(offsetof(struct mpmc_cell, msg) + value_size)
+                               : sizeof(struct mpmc_cell);
+    q->ch = ch;
+    if(posix_memalign((void**) &q->cells, CACHE_LINE, (size_t) capacity * q->stride) != 0) {
+        free(q);
+        return NULL;
+    }
+    for(i = 0; i < capacity; i++) {
+        cell = (struct mpmc_cell*) (q->cells + i * q->stride);
+        cell->seq = i;
+        cell->msg = NULL;
+    }
+    return q;
+}
+
+static struct mpmc_cell* cell_at(struct mpmc* q, unsigned long pos) {
+    return (struct mpmc_cell*) (q->cells + (pos & q->mask) * q->stride);
+}
+
+static void mpmc_free(struct mpmc* q) {
+    if(q != NULL) {
+        free(q->cells);
+        free(q);
+    }
+}
+
+static int mpmc_pending(struct mpmc* q) {
+    unsigned long pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_ACQUIRE);
+    struct mpmc_cell* cell = cell_at(q, pos);
+    return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+static int mpmc_full(struct mpmc* q) {
+    unsigned long pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_ACQUIRE);
+    struct mpmc_cell* cell = cell_at(q, pos);
+    return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos;
+}
+
+/*
+ * Sleeps on *gen unless ready() turns true after we registered as a
+ * waiter. Whoever makes ready() true bumps *gen after looking at *waiters,
+ * so either we see its change here or it sees us and wakes us up.
+ */
+static void mpmc_park(struct mpmc* q, int* waiters, unsigned int* gen,
+                      int (*ready)(struct mpmc*), const struct timespec* deadline) {
+    struct spin sp;
+    unsigned int seen;
+    int ok;
+    spin_start(&sp, q->ch);
+    while(!(ok = ready(q)) && spin_more(&sp)) {
+    }
+    spin_end(&sp, ok);
+    if(ok) {
+        return;
+    }
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    seen = __atomic_load_n(gen, __ATOMIC_SEQ_CST);
+    if(!ready(q) && !ch_closed(q->ch)) {
+        futex_wait_until(gen, seen, deadline);
+    }
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_RELAXED);
+}
+
+static void mpmc_unpark(int* waiters, unsigned int* gen, int count) {
+    if(count == 0) {
+        return;
+    }
+    fence_before_load(waiters);
+    if(__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0) {
+        __atomic_add_fetch(gen, 1, __ATOMIC_SEQ_CST);
+        futex_wake(gen, count);
+    }
+}
+
+static int mpmc_not_full(struct mpmc* q) {
+    return !mpmc_full(q);
+}
+
+/*
+ * Claims one cell and stores msg in it without waking anyone.
+ */
+static int mpmc_put(struct mpmc* q, const char* msg, const struct timespec* deadline) {
+    struct mpmc_cell* cell;
+    unsigned long pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    long diff, began = 0;
+    for(;;) {
+        cell = cell_at(q, pos);
+        diff = (long) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if(diff < 0) {
+            // the queue is full
+            if(expired(deadline) || ch_closed(q->ch)) {
+                wait_done(q->ch, SEND_SIDE, began);
+                return 0;
+            }
+            began = wait_mark(began, deadline);
+            mpmc_park(q, &q->send_waiters, &q->send_gen, mpmc_not_full, deadline);
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    copy_msg((char*) &cell->msg, msg, q->size);
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    wait_done(q->ch, SEND_SIDE, began);
+    return 1;
+}
+
+/*
+ * Takes the message out of one cell without waking anyone.
+ */
+static int mpmc_take(struct mpmc* q, char* dest, const struct timespec* deadline) {
+    struct mpmc_cell* cell;
+    unsigned long pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    long diff, began = 0;
+    for(;;) {
+        cell = cell_at(q, pos);
+        diff = (long) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if(diff < 0) {
+            // the queue is empty, and stays so once it is closed
+            if(expired(deadline) || (ch_closed(q->ch) && !mpmc_pending(q))) {
+                wait_done(q->ch, RECV_SIDE, began);
+                return 0;
+            }
+            began = wait_mark(began, deadline);
+            mpmc_park(q, &q->recv_waiters, &q->recv_gen, mpmc_pending, deadline);
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    copy_msg(dest, (char*) &cell->msg, q->size);
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    wait_done(q->ch, RECV_SIDE, began);
+    return 1;
+}
+
+/*
+ * Sends up to n messages and wakes at most one receiver per message, all
+ * in one go. Before parking on a full queue the messages sent so far are
+ * announced, so their receivers are not left asleep.
+ */
+static int mpmc_send_many(struct mpmc* q, const char* msgs, int n,
+                          const struct timespec* deadline) {
+    int sent, unannounced = 0;
+    for(sent = 0; sent < n; sent++) {
+        if(!mpmc_put(q, msgs + sent * q->size, &no_wait)) {
+            if(unannounced > 0) {
+                mpmc_unpark(&q->recv_waiters, &q->recv_gen, unannounced);
+                notify_watchers(q->ch);
+            }
+            unannounced = 0;
+            if(!mpmc_put(q, msgs + sent * q->size, deadline)) {
+                break;
+            }
+        }
+        unannounced++;
+    }
+    if(unannounced > 0) {
+        mpmc_unpark(&q->recv_waiters, &q->recv_gen, unannounced);
+        notify_watchers(q->ch);
+    }
+    return sent;
+}
+
+static int mpmc_recv_many(struct mpmc* q, char* dest, int max,
+                          const struct timespec* deadline) {
+    int got;
+    if(!mpmc_take(q, dest, deadline)) {
+        return 0;
+    }
+    for(got = 1; got < max; got++) {
+        if(!mpmc_take(q, dest + got * q->size, &no_wait)) {
+            break;
+        }
+    }
+    mpmc_unpark(&q->send_waiters, &q->send_gen, got);
+    notify_watchers(q->ch);
+    return got;
+}
+
+/*
+ * Wakes every parked thread after the channel was marked closed; the
+ * generations move on, so none that is just about to park can miss it.
+ */
+static void mpmc_close(struct mpmc* q) {
+    __atomic_add_fetch(&q->send_gen, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&q->send_gen, INT_MAX);
+    __atomic_add_fetch(&q->recv_gen, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&q->recv_gen, INT_MAX);
+}
+
+/*
+ * Priority channels.
+ */
+
+static struct prio* prio_create(int capacity, int stride) {
+    struct prio* q = calloc(1, sizeof(*q));
+    if(q == NULL) {
+        return NULL;
+    }
+    if(posix_memalign((void**) &q->rings, CACHE_LINE,
+                      (size_t) CH_PRIORITIES * capacity * stride) != 0) {
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+static void prio_free(struct prio* q) {
+    if(q != NULL) {
+        free(q->rings);
+        free(q);
+    }
+}
+
+static void prio_put(struct channel* ch, const char* msg, int priority) {
+    struct prio* q = ch->prio;
+    unsigned int slot = q->tail[priority]++ & (ch->capacity - 1);
+    copy_msg(q->rings + ((size_t) priority * ch->capacity + slot) * ch->stride, msg, ch->size);
+    q->levels |= 1u << priority;
+}
+
+/*
+ * Takes the oldest message of the highest priority. There is one, since
+ * the channel's count says so.
+ */
+static void prio_take(struct channel* ch, char* dest) {
+    struct prio* q = ch->prio;
+    int priority = 31 - __builtin_clz(q->levels);
+    unsigned int slot = q->head[priority]++ & (ch->capacity - 1);
+    copy_msg(dest, q->rings + ((size_t) priority * ch->capacity + slot) * ch->stride, ch->size);
+    if(q->head[priority] == q->tail[priority]) {
+        q->levels &= ~(1u << priority);
+    }
+}
+
+/*
+ * Broadcast channels.
+ */
+
+static struct bcast* bcast_create(int capacity) {
+    struct bcast* q;
+    if(posix_memalign((void**) &q, CACHE_LINE, sizeof(*q)) != 0) {
+        return NULL;
+    }
+    bzero(q, sizeof(*q));
+    q->refs = calloc(capacity, sizeof(int));
+    q->ring = calloc(capacity, sizeof(void*));
+    if(q->refs == NULL || q->ring == NULL) {
+        free(q->refs);
+        free(q->ring);
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+static void bcast_free(struct bcast* q) {
+    int i;
+    if(q != NULL) {
+        for(i = 0; i < CH_MAX_SUBSCRIBERS; i++) {
+            free(q->subs[i]);
+        }
+        free(q->refs);
+        free(q->ring);
+        free(q);
+    }
+}
+
+static void bcast_release(struct channel* ch, void* msg) {
+    if(ch->ext != NULL && ch->ext->pool != NULL) {
+        ch_msg_free(msg);
+    } else {
+        free(msg);
+    }
+}
+
+/*
+ * Drops a subscription's reference to the message published as seq. The
+ * last one to let go releases it and wakes a publisher waiting for room.
+ */
+static void bcast_pass(struct channel* ch, unsigned int seq) {
+    struct bcast* q = ch->bcast;
+    unsigned int slot = seq & (ch->capacity - 1);
+    // read it before letting go, after which the slot may be reused
+    void* msg = q->ring[slot];
+    if(__atomic_sub_fetch(&q->refs[slot], 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    bcast_release(ch, msg);
+    __atomic_sub_fetch(&q->live, 1, __ATOMIC_RELAXED);
+    // pairs with send_waiters and send_seq in bcast_publish
+    __atomic_add_fetch(&q->send_seq, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&q->send_waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake(&q->send_seq, 1);
+    }
+    notify_watchers(ch);
+}
+
+/*
+ * Publishes up to n messages, each to every current subscription, and
+ * wakes the subscribers once per call. A message published while there
+ * are no subscriptions is released right away.
+ */
+static int bcast_publish(struct channel* ch, void* const* msgs, int n,
+                         const struct timespec* deadline) {
+    struct bcast* q = ch->bcast;
+    unsigned int seen, slot;
+    int sent = 0, published;
+    long began = 0;
+
+    for(;;) {
+        // read the sequence first, so a release we miss below bumps it
+        seen = __atomic_load_n(&q->send_seq, __ATOMIC_SEQ_CST);
+        published = 0;
+        lock(&ch->lock);
+        while(sent < n && !ch->closed) {
+            slot = q->tail & (ch->capacity - 1);
+            if(__atomic_load_n(&q->refs[slot], __ATOMIC_ACQUIRE) > 0) {
+                break;
+            }
+            if(q->n_subs == 0) {
+                bcast_release(ch, msgs[sent++]);
+                continue;
+            }
+            q->ring[slot] = msgs[sent++];
+            __atomic_store_n(&q->refs[slot], q->n_subs, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&q->live, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+            published++;
+        }
+        unlock(&ch->lock);
+        if(published > 0) {
+            // pairs with recv_waiters and recv_seq in bcast_recv
+            __atomic_add_fetch(&q->recv_seq, 1, __ATOMIC_SEQ_CST);
+            if(__atomic_load_n(&q->recv_waiters, __ATOMIC_SEQ_CST) > 0) {
+                futex_wake(&q->recv_seq, INT_MAX);
+            }
+            notify_watchers(ch);
+        }
+        if(sent == n || ch_closed(ch) || expired(deadline)) {
+            break;
+        }
+        began = wait_mark(began, deadline);
+        __atomic_add_fetch(&q->send_waiters, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&q->send_seq, __ATOMIC_SEQ_CST) == seen) {
+            futex_wait_until(&q->send_seq, seen, deadline);
+        }
+        __atomic_sub_fetch(&q->send_waiters, 1, __ATOMIC_RELAXED);
+    }
+    wait_done(ch, SEND_SIDE, began);
+    return sent;
+}
+
+/*
+ * Hands a subscription the next message it has not seen. It keeps its
+ * reference to the message until its next receive, so the message stays
+ * valid until then. returns 1 on success, 0 if the deadline passed first
+ * and CH_CLOSED once the channel is closed and the subscription has seen
+ * every message.
+ */
+static int bcast_recv(struct channel* ch, struct bcast_sub* s, void** dest,
+                      const struct timespec* deadline) {
+    struct bcast* q = ch->bcast;
+    unsigned int seen;
+    long began = 0;
+
+    if(s->held) {
+        bcast_pass(ch, s->cursor - 1);
+        s->held = 0;
+    }
+    for(;;) {
+        seen = __atomic_load_n(&q->recv_seq, __ATOMIC_SEQ_CST);
+        if(s->cursor != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if(ch_closed(ch)) {
+            // the close came after the last publish; make sure we saw it
+            if(s->cursor != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            wait_done(ch, RECV_SIDE, began);
+            return CH_CLOSED;
+        }
+        if(expired(deadline)) {
+            wait_done(ch, RECV_SIDE, began);
+            return 0;
+        }
+        began = wait_mark(began, deadline);
+        __atomic_add_fetch(&q->recv_waiters, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&q->recv_seq, __ATOMIC_SEQ_CST) == seen) {
+            futex_wait_until(&q->recv_seq, seen, deadline);
+        }
+        __atomic_sub_fetch(&q->recv_waiters, 1, __ATOMIC_RELAXED);
+    }
+    wait_done(ch, RECV_SIDE, began);
+    *dest = q->ring[s->cursor & (ch->capacity - 1)];
+    s->cursor++;
+    s->held = 1;
+    return 1;
+}
+
+static void bcast_close(struct bcast* q) {
+    __atomic_add_fetch(&q->send_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&q->send_seq, INT_MAX);
+    __atomic_add_fetch(&q->recv_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&q->recv_seq, INT_MAX);
+}
+
+/*
+ * Rendezvous channels.
+ */
+
+static void rdv_push(struct rdv_queue* q, struct rdv_wait* w) {
+    w->next = NULL;
+    if(q->tail == NULL) {
+        q->head = w;
+    } else {
+        q->tail->next = w;
+    }
+    q->tail = w;
+    __atomic_store_n(&q->n, q->n + 1, __ATOMIC_RELEASE);
+}
+
+static struct rdv_wait* rdv_pop(struct rdv_queue* q) {
+    struct rdv_wait* w = q->head;
+    if(w != NULL) {
+        q->head = w->next;
+        if(q->head == NULL) {
+            q->tail = NULL;
+        }
+        __atomic_store_n(&q->n, q->n - 1, __ATOMIC_RELEASE);
+    }
+    return w;
+}
+
+/*
+ * Takes a record that gave up waiting off its queue. returns 0 if a
+ * partner has already taken it off, and is about to set its state.
+ */
+static int rdv_remove(struct rdv_queue* q, struct rdv_wait* w) {
+    struct rdv_wait* prev = NULL;
+    struct rdv_wait* p;
+    for(p = q->head; p != NULL && p != w; p = p->next) {
+        prev = p;
+    }
+    if(p == NULL) {
+        return 0;
+    }
+    if(prev == NULL) {
+        q->head = w->next;
+    } else {
+        prev->next = w->next;
+    }
+    if(q->tail == w) {
+        q->tail = prev;
+    }
+    __atomic_store_n(&q->n, q->n - 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void rdv_wake(struct rdv_wait* w, unsigned int state) {
+    // w lives on the stack of a thread that may return as soon as it sees
+    // the state, after which waking the address is harmless
+    __atomic_store_n(&w->state, state, __ATOMIC_RELEASE);
+    futex_wake(&w->state, 1);
+}
+
+/*
+ * Hands one message over: from msg to a receiver if side is SEND_SIDE,
+ * from a sender into msg otherwise. Takes the oldest partner parked on
+ * the other side if there is one, and otherwise parks on ours until a
+ * partner takes us, the deadline passes or the channel is closed.
+ * returns 1 if the message was handed over and 0 if not.
+ */
+static int rdv_meet(struct channel* ch, char* msg, int side,
+                    const struct timespec* deadline) {
+    struct rdv_queue* mine = side == SEND_SIDE ? &ch->rdv->senders : &ch->rdv->receivers;
+    struct rdv_queue* theirs = side == SEND_SIDE ? &ch->rdv->receivers : &ch->rdv->senders;
+    struct rdv_wait self;
+    struct rdv_wait* other;
+    struct spin sp;
+    long began = 0;
+
+    lock(&ch->lock);
+    if(ch->closed) {
+        unlock(&ch->lock);
+        return 0;
+    }
+    other = rdv_pop(theirs);
+    if(other != NULL) {
+        if(side == SEND_SIDE) {
+            copy_msg(other->buf, msg, ch->size);
+        } else {
+            copy_msg(msg, other->buf, ch->size);
+        }
+        unlock(&ch->lock);
+        rdv_wake(other, RDV_DONE);
+        notify_watchers(ch);
+        return 1;
+    }
+    if(deadline == &no_wait) {
+        unlock(&ch->lock);
+        return 0;
+    }
+    self.buf = msg;
+    self.state = RDV_WAITING;
+    rdv_push(mine, &self);
+    unlock(&ch->lock);
+    // a parked sender is a pending message, a parked receiver is room
+    notify_watchers(ch);
+
+    began = wait_mark(began, deadline);
+    spin_start(&sp, ch);
+    while(__atomic_load_n(&self.state, __ATOMIC_ACQUIRE) == RDV_WAITING && spin_more(&sp)) {
+    }
+    spin_end(&sp, __atomic_load_n(&self.state, __ATOMIC_ACQUIRE) != RDV_WAITING);
+    while(__atomic_load_n(&self.state, __ATOMIC_ACQUIRE) == RDV_WAITING) {
+        if(expired(deadline)) {
+            lock(&ch->lock);
+            if(rdv_remove(mine, &self)) {
+                unlock(&ch->lock);
+                wait_done(ch, side, began);
+                notify_watchers(ch);
+                return 0;
+            }
+            unlock(&ch->lock);
+            // taken just now: the partner sets the state any moment
+            deadline = NULL;
+            continue;
+        }
+        futex_wait_until(&self.state, RDV_WAITING, deadline);
+    }
+    wait_done(ch, side, began);
+    return __atomic_load_n(&self.state, __ATOMIC_ACQUIRE) == RDV_DONE;
+}
+
+static int rdv_send_many(struct channel* ch, const char* msgs, int n,
+                         const struct timespec* deadline) {
+    int sent = 0;
+    while(sent < n && rdv_meet(ch, (char*) msgs + sent * ch->size, SEND_SIDE, deadline)) {
+        sent++;
+    }
+    return sent;
+}
+
+/*
+ * Waits for the first message only, then takes whatever other senders
+ * are parked right now.
+ */
+static int rdv_recv_many(struct channel* ch, char* dest, int max,
+                         const struct timespec* deadline) {
+    int got = 0;
+    while(got < max && rdv_meet(ch, dest + got * ch->size, RECV_SIDE,
+                                got == 0 ? deadline : &no_wait)) {
+        got++;
+    }
+    return got;
+}
+
+/*
+ * Sends the parked senders and receivers away empty-handed. Called after
+ * closed is set, so no-one parks anymore.
+ */
+static void rdv_close(struct channel* ch) {
+    struct rdv_wait* w;
+    lock(&ch->lock);
+    while((w = rdv_pop(&ch->rdv->senders)) != NULL) {
+        rdv_wake(w, RDV_CLOSED);
+    }
+    while((w = rdv_pop(&ch->rdv->receivers)) != NULL) {
+        rdv_wake(w, RDV_CLOSED);
+    }
+    unlock(&ch->lock);
+}
+
+/*
+ * Shared channels.
+ */
+
+static struct shm* shm_attach(const char* name, const ch_attr* attr) {
+    int block_size = sizeof(struct shm_block) + ((attr->msg_size + 15) & ~15);
+    int n_blocks = 2 * attr->capacity;
+    size_t arena = (sizeof(struct shm) + attr->capacity * sizeof(unsigned long) +
+                    CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+    size_t size = arena + (size_t) n_blocks * block_size;
+    struct shm_block* b;
+    struct shm* r;
+    struct stat st;
+    int fd, i, tries;
+
+    if(strlen(name) >= sizeof(r->name)) {
+        printf("shared channel name %s is too long\n", name);
+        return NULL;
+    }
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd >= 0) {
+        // we made it, so we lay it out
+        if(ftruncate(fd, size) < 0) {
+            perror("ftruncate");
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+        r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(r == MAP_FAILED) {
+            perror("mmap");
+            shm_unlink(name);
+            return NULL;
+        }
+        strcpy(r->name, name);
+        r->size = size;
+        r->capacity = attr->capacity;
+        r->msg_size = attr->msg_size;
+        r->block_size = block_size;
+        r->arena = arena;
+        for(i = n_blocks - 1; i >= 0; i--) {
+            b = (struct shm_block*) ((char*) r + arena + (size_t) i * block_size);
+            b->owner = SHM_BLOCK;
+            b->offset = (char*) b - (char*) r;
+            *(unsigned long*) b->msg = r->free_list;
+            r->free_list = b->offset;
+        }
+        r->users = 1;
+        __atomic_store_n(&r->ready, SHM_READY, __ATOMIC_RELEASE);
+        return r;
+    }
+    if(errno != EEXIST) {
+        perror("shm_open");
+        return NULL;
+    }
+
+    // somebody else made it: wait for them to finish laying it out
+    fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0) {
+        perror("shm_open");
+        return NULL;
+    }
+    for(tries = 0; fstat(fd, &st) == 0 && st.st_size < (off_t) sizeof(struct shm); tries++) {
+        if(tries == 1000) {
+            printf("shared channel %s was never set up\n", name);
+            close(fd);
+            return NULL;
+        }
+        usleep(1000);
+    }
+    r = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(r == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    for(tries = 0; __atomic_load_n(&r->ready, __ATOMIC_ACQUIRE) != SHM_READY; tries++) {
+        if(tries == 1000) {
+            printf("shared channel %s was never set up\n", name);
+            munmap(r, st.st_size);
+            return NULL;
+        }
+        usleep(1000);
+    }
+    if(r->capacity != attr->capacity || r->msg_size != attr->msg_size) {
+        printf("shared channel %s has capacity %d and msg_size %d\n", name,
+               r->capacity, r->msg_size);
+        munmap(r, st.st_size);
+        return NULL;
+    }
+    __atomic_add_fetch(&r->users, 1, __ATOMIC_RELAXED);
+    return r;
+}
+
+/*
+ * Unmaps a shared channel; the last process to let go of it removes its
+ * name as well.
+ */
+static void shm_detach(struct shm* r) {
+    if(r == NULL) {
+        return;
+    }
+    if(__atomic_sub_fetch(&r->users, 1, __ATOMIC_ACQ_REL) == 0) {
+        shm_unlink(r->name);
+    }
+    munmap(r, r->size);
+}
+
+static void* shm_alloc(struct channel* ch) {
+    struct shm* r = ch->shm;
+    struct shm_block* b;
+    lock_as(&r->lock, 0);
+    // every block is in use: wait for one to come back
+    while(r->free_list == 0 && !r->closed) {
+        cond_wait_as(&r->free_cond, &r->lock, NULL, 0);
+    }
+    if(r->free_list == 0) {
+        unlock_as(&r->lock, 0);
+        printf("shared channel %s is closed\n", r->name);
+        return NULL;
+    }
+    b = (struct shm_block*) ((char*) r + r->free_list);
+    r->free_list = *(unsigned long*) b->msg;
+    unlock_as(&r->lock, 0);
+    return b->msg;
+}
+
+static void shm_free(struct shm_block* b) {
+    struct shm* r = (struct shm*) ((char*) b - b->offset);
+    lock_as(&r->lock, 0);
+    *(unsigned long*) b->msg = r->free_list;
+    r->free_list = b->offset;
+    cond_signal_as(&r->free_cond, 1, 0);
+    unlock_as(&r->lock, 0);
+}
 
 /*
- * Locking mechanisms.
+ * Turns a message into its offset in the mapping, or returns 0 if it was
+ * not allocated from this channel.
  */
+static unsigned long shm_offset(struct shm* r, const void* msg) {
+    unsigned long off = (const char*) msg - (const char*) r;
+    struct shm_block* b;
+    if((const char*) msg < (const char*) r || off < r->arena + sizeof(struct shm_block) ||
+       off >= r->size) {
+        return 0;
+    }
+    b = (struct shm_block*) ((char*) msg - offsetof(struct shm_block, msg));
+    if(b->owner != SHM_BLOCK || b->offset != off - offsetof(struct shm_block, msg)) {
+        return 0;
+    }
+    return off;
+}
+
+static int shm_send_many(struct channel* ch, void* const* msgs, int n,
+                         const struct timespec* deadline) {
+    struct shm* r = ch->shm;
+    unsigned long off;
+    long began = 0;
+    int i, sent = 0;
+    for(i = 0; i < n; i++) {
+        if(shm_offset(r, msgs[i]) == 0) {
+            printf("message was not allocated from shared channel %s\n", r->name);
+            return -1;
+        }
+    }
+    lock_as(&r->lock, 0);
+    while(sent < n && !r->closed) {
+        while(r->count == r->capacity && !r->closed) {
+            began = wait_mark(began, deadline);
+            if(cond_wait_as(&r->send_cond, &r->lock, deadline, 0) < 0) {
+                break;
+            }
+        }
+        if(r->count == r->capacity || r->closed) {
+            break;
+        }
+        for(i = 0; r->count < r->capacity && sent < n; i++, sent++) {
+            off = shm_offset(r, msgs[sent]);
+            r->ring[r->tail] = off;
+            r->tail = (r->tail + 1) % r->capacity;
+            r->count++;
+        }
+        cond_signal_as(&r->recv_cond, i, 0);
+    }
+    unlock_as(&r->lock, 0);
+    notify_watchers(ch);
+    wait_done(ch, SEND_SIDE, began);
+    return sent;
+}
+
+static int shm_recv_many(struct channel* ch, void** dest, int max,
+                         const struct timespec* deadline) {
+    struct shm* r = ch->shm;
+    long began = 0;
+    int k;
+    lock_as(&r->lock, 0);
+    while(r->count == 0 && !r->closed) {
+        began = wait_mark(began, deadline);
+        if(cond_wait_as(&r->recv_cond, &r->lock, deadline, 0) < 0) {
+            break;
+        }
+    }
+    for(k = 0; r->count > 0 && k < max; k++) {
+        dest[k] = (char*) r + r->ring[r->head];
+        r->head = (r->head + 1) % r->capacity;
+        r->count--;
+    }
+    if(k > 0) {
+        cond_signal_as(&r->send_cond, k, 0);
+    }
+    unlock_as(&r->lock, 0);
+    if(k > 0) {
+        notify_watchers(ch);
+    }
+    wait_done(ch, RECV_SIDE, began);
+    return k;
+}
 
-pthread_mutex_t send_mutexes[CHANNELS];
-pthread_mutex_t recv_mutexes[CHANNELS];
+/*
+ * Closes the channel for every process that has it open.
+ */
+static void shm_close(struct shm* r) {
+    lock_as(&r->lock, 0);
+    __atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+    cond_signal_as(&r->send_cond, INT_MAX, 0);
+    cond_signal_as(&r->recv_cond, INT_MAX, 0);
+    cond_signal_as(&r->free_cond, INT_MAX, 0);
+    unlock_as(&r->lock, 0);
+}
 
-pthread_cond_t send_cond[CHANNELS];
-pthread_cond_t recv_cond[CHANNELS];
+/*
+ * Message pools.
+ */
 
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
 
+static void pool_flush(struct pool_cache* c);
 
 /*
- * Set up.
+ * Runs when a thread exits. Each of its caches whose pool is still open
+ * hands its batch for other threads back and then waits on the pool's
+ * idle list for the next thread to join. table_lock keeps the pools from
+ * being freed meanwhile.
  */
- 
-int ch_setup() {
-	// must be called exactly once before using any channels
-	// how is it not safe to use library? think of scenarios
-	// return 0 on success or < 0 on error
-    
-    // if this was called previously, then the fds[0] would not be NULL
-    if(fds[0].fd != 0) {
-        printf("set up has been called previously\n");
+static void forget_pools(void* refs) {
+    struct pool_ref** mine = refs;
+    struct pool_ref* ref;
+    struct channel* ch;
+    struct pool* p;
+    int i, j;
+    my_pools = NULL;
+    lock(&table_lock);
+    for(i = 0; i < CHUNKS; i++) {
+        for(j = 0; mine[i] != NULL && j < CHUNK_SIZE; j++) {
+            ref = &mine[i][j];
+            ch = lookup((i << CHUNK_BITS) + j);
+            if(ref->cache == NULL || ch == NULL || ch->ext == NULL ||
+               (p = ch->ext->pool) == NULL || p->gen != ref->gen) {
+                continue;
+            }
+            pool_flush(ref->cache);
+            lock(&p->lock);
+            ref->cache->idle_next = p->idle;
+            p->idle = ref->cache;
+            unlock(&p->lock);
+        }
+        free(mine[i]);
+    }
+    unlock(&table_lock);
+    free(mine);
+}
+
+static void make_pool_key() {
+    pthread_key_create(&pool_key, forget_pools);
+}
+
+static struct pool* pool_create(int channel, size_t size) {
+    struct pool* p = calloc(1, sizeof(*p));
+    if(p == NULL) {
+        return NULL;
+    }
+    // payloads stay 16-byte aligned, like malloc's
+    p->size = (size + 15) & ~(size_t) 15;
+    p->channel = channel;
+    p->gen = __atomic_add_fetch(&pool_gen, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+static void pool_free(struct pool* p) {
+    struct pool_slab* slab;
+    struct pool_cache* c;
+    if(p == NULL) {
+        return;
+    }
+    while((slab = p->slabs) != NULL) {
+        p->slabs = slab->next;
+        free(slab);
+    }
+    while((c = p->caches) != NULL) {
+        p->caches = c->next;
+        free(c);
+    }
+    free(p);
+}
+
+/*
+ * Takes over the cache of a thread that has exited, or creates a new one,
+ * for the calling thread and files it under the pool's channel number in
+ * the thread's own table.
+ */
+static struct pool_cache* join_pool(struct pool* p) {
+    struct pool_ref** refs = my_pools;
+    struct pool_ref** chunk;
+    struct pool_cache* c;
+
+    if(refs == NULL) {
+        pthread_once(&pool_key_once, make_pool_key);
+        refs = calloc(CHUNKS, sizeof(struct pool_ref*));
+        if(refs == NULL) {
+            return NULL;
+        }
+        pthread_setspecific(pool_key, refs);
+        my_pools = refs;
+    }
+    chunk = &refs[p->channel >> CHUNK_BITS];
+    if(*chunk == NULL) {
+        *chunk = calloc(CHUNK_SIZE, sizeof(struct pool_ref));
+        if(*chunk == NULL) {
+            return NULL;
+        }
+    }
+    lock(&p->lock);
+    c = p->idle;
+    if(c != NULL) {
+        p->idle = c->idle_next;
+    }
+    unlock(&p->lock);
+    if(c == NULL) {
+        if(posix_memalign((void**) &c, CACHE_LINE, sizeof(*c)) != 0) {
+            return NULL;
+        }
+        bzero(c, sizeof(*c));
+        c->pool = p;
+        lock(&p->lock);
+        c->next = p->caches;
+        p->caches = c;
+        unlock(&p->lock);
+    }
+    (*chunk)[p->channel & (CHUNK_SIZE - 1)].gen = p->gen;
+    (*chunk)[p->channel & (CHUNK_SIZE - 1)].cache = c;
+    return c;
+}
+
+static struct pool_cache* my_cache(struct pool* p) {
+    struct pool_ref* chunk;
+    struct pool_ref* ref;
+    if(my_pools != NULL && (chunk = my_pools[p->channel >> CHUNK_BITS]) != NULL) {
+        ref = &chunk[p->channel & (CHUNK_SIZE - 1)];
+        // a stale entry from a closed channel never matches a newer pool
+        if(ref->gen == p->gen) {
+            return ref->cache;
+        }
+    }
+    return join_pool(p);
+}
+
+/*
+ * Carves a new slab into blocks owned by cache c.
+ */
+static int pool_grow(struct pool* p, struct pool_cache* c) {
+    size_t block = sizeof(struct pool_block) + p->size;
+    struct pool_slab* slab;
+    struct pool_block* b;
+    int i;
+    if(posix_memalign((void**) &slab, CACHE_LINE,
+                      sizeof(*slab) + POOL_SLAB * block) != 0) {
         return -1;
     }
-    int error, i;
-    for(i = 0; i < CHANNELS; i++) {
-        socket_fds[i] = socket(AF_INET, SOCK_STREAM, 0);
-        if(socket_fds[i] < 0) {
-            printf("error opening server socket %d\n", i);
-            return -1;
+    for(i = POOL_SLAB - 1; i >= 0; i--) {
+        b = (struct pool_block*) (slab->blocks + i * block);
+        b->owner = c;
+        b->next = c->local;
+        c->local = b;
+    }
+    lock(&p->lock);
+    slab->next = p->slabs;
+    p->slabs = slab;
+    unlock(&p->lock);
+    return 0;
+}
+
+/*
+ * Hands the blocks collected for another thread back to it with a single
+ * compare-and-swap on its remote list.
+ */
+static void pool_flush(struct pool_cache* c) {
+    struct pool_cache* owner = c->out_owner;
+    struct pool_block* head;
+    if(c->out_n == 0) {
+        return;
+    }
+    head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    do {
+        c->out_tail->next = head;
+    } while(!__atomic_compare_exchange_n(&owner->remote, &head, c->out_head, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    c->out_head = NULL;
+    c->out_tail = NULL;
+    c->out_n = 0;
+}
+
+void* ch_msg_alloc(int channel) {
+    struct channel* ch = lookup(channel);
+    struct pool* p;
+    struct pool_cache* c;
+    struct pool_block* b;
+    if(ch != NULL && ch->mode == CH_MODE_SHARED) {
+        return shm_alloc(ch);
+    }
+    if(ch == NULL || ch->ext == NULL || (p = ch->ext->pool) == NULL) {
+        printf("channel %d has no message pool\n", channel);
+        return NULL;
+    }
+    c = my_cache(p);
+    if(c == NULL) {
+        printf("error allocating message pool cache\n");
+        return NULL;
+    }
+    if(c->local == NULL) {
+        // take back whatever other threads have returned so far
+        c->local = __atomic_exchange_n(&c->remote, NULL, __ATOMIC_ACQUIRE);
+        if(c->local == NULL && pool_grow(p, c) < 0) {
+            printf("error allocating messages for channel %d\n", channel);
+            return NULL;
         }
     }
+    b = c->local;
+    c->local = b->next;
+    return b->msg;
+}
+
+void ch_msg_free(void* msg) {
+    struct pool_block* b;
+    struct pool_cache* c;
+    if(msg == NULL) {
+        return;
+    }
+    b = (struct pool_block*) ((char*) msg - offsetof(struct pool_block, msg));
+    if(b->owner == SHM_BLOCK) {
+        shm_free((struct shm_block*) b);
+        return;
+    }
+    c = my_cache(b->owner->pool);
+    if(c == NULL) {
+        // no cache of our own: give the block straight back to its owner
+        struct pool_block* head = __atomic_load_n(&b->owner->remote, __ATOMIC_RELAXED);
+        do {
+            b->next = head;
+        } while(!__atomic_compare_exchange_n(&b->owner->remote, &head, b, 1,
+                                             __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        return;
+    }
+    if(b->owner == c) {
+        b->next = c->local;
+        c->local = b;
+        return;
+    }
+    if(b->owner != c->out_owner) {
+        pool_flush(c);
+        c->out_owner = b->owner;
+    }
+    b->next = NULL;
+    if(c->out_tail == NULL) {
+        c->out_head = b;
+    } else {
+        c->out_tail->next = b;
+    }
+    c->out_tail = b;
+    if(++c->out_n == POOL_BATCH) {
+        pool_flush(c);
+    }
+}
+
+int ch_has_pool(int channel) {
+    struct channel* ch = lookup(channel);
+    if(ch == NULL) {
+        printf("You've asked about the pool of a nonexistent channel.\n");
+        return -1;
+    }
+    return ch->mode == CH_MODE_SHARED || (ch->ext != NULL && ch->ext->pool != NULL);
+}
+
+/*
+ * Open.
+ */
+
+void ch_attr_init(ch_attr* attr) {
+    bzero(attr, sizeof(*attr));
+    attr->capacity = 1;
+    attr->mode = CH_MODE_LOCKED;
+    attr->spin = CH_SPIN_DEFAULT;
+}
+
+static int check_attr(const ch_attr* attr) {
+    if(attr->capacity < 0 || attr->capacity > CH_MAX_CAPACITY ||
+       (attr->capacity & (attr->capacity - 1)) != 0) {
+        printf("capacity %d is neither 0 nor a power of two\n", attr->capacity);
+        return -1;
+    }
+    if(attr->mode != CH_MODE_LOCKED && attr->mode != CH_MODE_SPSC &&
+       attr->mode != CH_MODE_MPMC && attr->mode != CH_MODE_PRIORITY &&
+       attr->mode != CH_MODE_SHARED && attr->mode != CH_MODE_BROADCAST) {
+        printf("unknown channel mode %d\n", attr->mode);
+        return -1;
+    }
+    if(attr->mode == CH_MODE_MPMC && attr->capacity < 2) {
+        printf("CH_MODE_MPMC needs a capacity of at least 2\n");
+        return -1;
+    }
+    if(attr->value_size < 0 || attr->value_size > CH_MAX_VALUE_SIZE) {
+        printf("value size %d is out of range\n", attr->value_size);
+        return -1;
+    }
+    if(attr->spin < CH_SPIN_DEFAULT) {
+        printf("spin limit %d is negative\n", attr->spin);
+        return -1;
+    }
+    if(attr->msg_size < 0) {
+        printf("message size %d is negative\n", attr->msg_size);
+        return -1;
+    }
+    if(attr->mode == CH_MODE_SHARED &&
+       (attr->name == NULL || attr->msg_size == 0 || attr->value_size > 0)) {
+        printf("CH_MODE_SHARED needs a name and a msg_size, and carries no values\n");
+        return -1;
+    }
+    if(attr->capacity == 0 &&
+       (attr->mode != CH_MODE_LOCKED || backend != CH_BACKEND_MEMORY)) {
+        printf("capacity 0 needs CH_MODE_LOCKED and the memory backend\n");
+        return -1;
+    }
+    if(attr->mode == CH_MODE_BROADCAST && attr->value_size > 0) {
+        printf("CH_MODE_BROADCAST carries no values\n");
+        return -1;
+    }
+    if(attr->mode != CH_MODE_LOCKED && backend != CH_BACKEND_MEMORY) {
+        printf("channel mode %d needs the memory backend\n", attr->mode);
+        return -1;
+    }
+    return 0;
+}
 
-    for(i = 0; i < CHANNELS; i++) {
-        client_fds[i] = socket(AF_INET, SOCK_STREAM, 0);
-        if(client_fds[i] < 0) {
-            printf("error opening client socket %d\n", i);
+/*
+ * Picks the number for a new channel: a recently closed one if there is
+ * one, otherwise the lowest number never handed out. Called with
+ * table_lock held.
+ */
+static int pick_id() {
+    struct channel* chunk;
+    int id;
+    while(n_free > 0) {
+        id = free_ids[--n_free];
+        // it may have been reopened by number in the meantime
+        if(lookup(id) == NULL) {
+            return id;
+        }
+    }
+    for(;;) {
+        if(next_id >= CH_MAX_CHANNELS) {
             return -1;
         }
+        chunk = chunks[next_id >> CHUNK_BITS];
+        if(chunk == NULL || !chunk[next_id & (CHUNK_SIZE - 1)].open) {
+            return next_id++;
+        }
+        next_id++;
     }
+}
 
-    // set socket to be reusable
-    for(i = 0; i < CHANNELS; i++) {
-        error = setsockopt(socket_fds[i], SOL_SOCKET, SO_REUSEADDR,
-                           (char *) &on, sizeof(on));
-        if(error < 0) {
-            printf("error on setting socket %d to reusable\n", i);
-            return -1;
+/*
+ * Returns the slot for a channel number, allocating its chunk if need be.
+ * Called with table_lock held.
+ */
+static struct channel* slot_for(int channel) {
+    struct channel* chunk = chunks[channel >> CHUNK_BITS];
+    if(chunk == NULL) {
+        if(posix_memalign((void**) &chunk, CACHE_LINE,
+                          CHUNK_SIZE * sizeof(struct channel)) != 0) {
+            return NULL;
         }
+        bzero(chunk, CHUNK_SIZE * sizeof(struct channel));
+        __atomic_store_n(&chunks[channel >> CHUNK_BITS], chunk, __ATOMIC_RELEASE);
     }
+    return &chunk[channel & (CHUNK_SIZE - 1)];
+}
 
-    for(i = 0; i < CHANNELS; i++) {
-        bzero((char *) &serv_addr[i], sizeof(serv_addr[i]));
-        serv_addr[i].sin_family = AF_INET;
-        serv_addr[i].sin_addr.s_addr = INADDR_ANY;
-        serv_addr[i].sin_port = htons(ports[i]);
+int ch_open(int channel, const ch_attr* attr) {
+    ch_attr defaults;
+    struct channel* ch;
+    struct channel fresh;
+    struct channel_ext* ext;
+    struct pool* pool = NULL;
+    int spin_limit, needs_ext, busy, err;
+
+    if(attr == NULL) {
+        ch_attr_init(&defaults);
+        attr = &defaults;
+    }
+    if(!setup_done) {
+        printf("Channels have not been set up.\n");
+        return -1;
+    }
+    if(channel != CH_NEW && (channel < 0 || channel >= CH_MAX_CHANNELS)) {
+        printf("You've tried to open a nonexistent channel.\n");
+        return -1;
+    }
+    if(check_attr(attr) < 0) {
+        return -1;
     }
 
-    for(i = 0; i < CHANNELS; i++) {
-        if(bind(socket_fds[i], (struct sockaddr *) &serv_addr[i],
-                sizeof(serv_addr[i])) < 0) {
-            printf("error on binding channel %d\n", i);
+    lock(&table_lock);
+    if(channel == CH_NEW) {
+        channel = pick_id();
+        if(channel < 0) {
+            unlock(&table_lock);
+            printf("out of channel numbers\n");
             return -1;
         }
     }
+    ch = slot_for(channel);
+    if(ch == NULL) {
+        unlock(&table_lock);
+        printf("error allocating channel %d\n", channel);
+        return -1;
+    }
 
-    for(i = 0; i < CHANNELS; i++) {
-        listen(socket_fds[i], 5);
-        clilen[i] = sizeof(cli_addr[i]);
+    // build the new queue aside, then swap it in
+    bzero(&fresh, sizeof(fresh));
+    fresh.mode = attr->mode;
+    fresh.capacity = attr->capacity;
+    fresh.value_size = attr->value_size;
+    fresh.size = msg_size(attr->value_size);
+    fresh.stride = slot_stride(attr->value_size);
+    spin_limit = attr->spin == CH_SPIN_DEFAULT ? spin_default : attr->spin;
+    if(attr->mode == CH_MODE_SPSC) {
+        fresh.spsc = spsc_create(ch, attr->capacity, attr->value_size);
+    } else if(attr->mode == CH_MODE_MPMC) {
+        fresh.mpmc = mpmc_create(ch, attr->capacity, attr->value_size);
+    } else if(attr->mode == CH_MODE_PRIORITY) {
+        fresh.prio = prio_create(attr->capacity, fresh.stride);
+    } else if(attr->mode == CH_MODE_BROADCAST) {
+        fresh.bcast = bcast_create(attr->capacity);
+    } else if(attr->mode == CH_MODE_SHARED) {
+        fresh.shm = shm_attach(attr->name, attr);
+    } else if(attr->capacity == 0) {
+        fresh.rdv = calloc(1, sizeof(struct rdv));
+    } else if(backend == CH_BACKEND_MEMORY && attr->value_size > 0) {
+        if(posix_memalign((void**) &fresh.ring, CACHE_LINE,
+                          (size_t) attr->capacity * fresh.stride) != 0) {
+            fresh.ring = NULL;
+        }
+    } else if(backend == CH_BACKEND_MEMORY && attr->capacity > 1) {
+        fresh.ring = calloc(attr->capacity, sizeof(void*));
+    } else {
+        fresh.ring = &ch->slot;
+    }
+    if(fresh.ring == NULL) {
+        unlock(&table_lock);
+        printf("error allocating ring for channel %d\n", channel);
+        return -1;
     }
-    
-    // set up the poll array of fds
-    bzero(fds, sizeof(fds));
-    for(i = 0; i < CHANNELS; i++) {
-        fds[i].fd = socket_fds[i];
-        fds[i].events = POLLIN;
+    if(attr->msg_size > 0 && attr->mode != CH_MODE_SHARED) {
+        pool = pool_create(channel, attr->msg_size);
+        if(pool == NULL) {
+            unlock(&table_lock);
+            printf("error allocating message pool for channel %d\n", channel);
+            goto fail;
+        }
     }
+    needs_ext = backend == CH_BACKEND_SOCKET || pool != NULL || spin_limit != spin_default;
 
-    for(i = 0; i < CHANNELS; i++) {
-        if(connect(client_fds[i], (struct sockaddr *) &serv_addr[i],
-                   sizeof(serv_addr[i])) < 0) {
-            printf("error connecting %d\n", i);
-            return -1;
+    if(!ch->open) {
+        bzero(ch, sizeof(*ch));
+        err = needs_ext && ext_of(ch) == NULL ? -1 : 0;
+        if(err < 0) {
+            printf("error allocating channel %d\n", channel);
+        } else if(backend == CH_BACKEND_SOCKET) {
+            err = open_socket(ch->ext, channel);
         }
+        if(err < 0) {
+            free_ext(ch);
+            unlock(&table_lock);
+            goto fail;
+        }
+        ch->mode = fresh.mode;
+        ch->capacity = fresh.capacity;
+        ch->value_size = fresh.value_size;
+        ch->size = fresh.size;
+        ch->stride = fresh.stride;
+        ch->ring = fresh.ring;
+        if(ch->ext != NULL) {
+            ch->ext->spin_limit = spin_limit;
+            ch->ext->spins = spin_limit < SPIN_MIN ? spin_limit : SPIN_MIN;
+            ch->ext->pool = pool;
+        }
+        __atomic_store_n(&ch->open, 1, __ATOMIC_RELEASE);
+        unlock(&table_lock);
+        return channel;
     }
-    
-    for(i = 0; i < CHANNELS; i++) {
-        fds[i+16].fd = client_fds[i];
-        fds[i+16].events = POLLIN;
+
+    // reopening a channel that is in use: it must be empty
+    if(needs_ext && ext_of(ch) == NULL) {
+        unlock(&table_lock);
+        printf("error allocating channel %d\n", channel);
+        goto fail;
     }
-    
-    for(i = 0; i < CHANNELS; i++) {
-        new_fds[i] = accept(socket_fds[i], (struct sockaddr *) &cli_addr[i],
-                            &clilen[i]);
-        if(new_fds[i] < 0) {
-            printf("error accepting on %d\n", i);
-            return -1;
+    lock(&ch->lock);
+    busy = pending(ch);
+    if(!busy) {
+        free_queue(ch);
+        ch->mode = fresh.mode;
+        ch->capacity = fresh.capacity;
+        ch->value_size = fresh.value_size;
+        ch->size = fresh.size;
+        ch->stride = fresh.stride;
+        ch->ring = fresh.ring;
+        ch->sent = 0;
+        ch->high_water = 0;
+        ch->received = 0;
+        ch->count = 0;
+        ch->head = 0;
+        ch->tail = 0;
+        ch->closed = 0;
+        // a channel without an ext has the default spin limit and no pool
+        ext = ch->ext;
+        if(ext != NULL) {
+            ext->spin_limit = spin_limit;
+            ext->spins = spin_limit < SPIN_MIN ? spin_limit : SPIN_MIN;
+            free(ext->metrics);
+            ext->metrics = NULL;
+            // messages of the old pool may still be around if the size stays
+            if(ext->pool != NULL && pool != NULL && ext->pool->size == pool->size) {
+                pool_free(pool);
+            } else {
+                pool_free(ext->pool);
+                ext->pool = pool;
+            }
         }
     }
-    
-    for(i = 0; i < CHANNELS; i++) {
-        fds[i+8].fd = new_fds[i];
-        fds[i+8].events = POLLIN;
+    unlock(&ch->lock);
+    unlock(&table_lock);
+
+    if(busy) {
+        printf("channel %d still holds messages\n", channel);
+        goto fail;
     }
-    
-    // initialise locking mechanisms
-    for(i = 0; i < CHANNELS; i++) {
-        error = pthread_mutex_init(&send_mutexes[i], NULL);
-        if(error < 0) {
-            printf("error initializing send mutex %d\n", i);
-            return -1;
+    return channel;
+
+fail:
+    if(fresh.ring != &ch->slot) {
+        free_queue(&fresh);
+    }
+    pool_free(pool);
+    return -1;
+}
+
+/*
+ * Close.
+ */
+
+int ch_close(int channel) {
+    struct channel* ch = lookup(channel);
+    if(ch == NULL) {
+        printf("You've tried to close a nonexistent channel.\n");
+        return -1;
+    }
+    if(ch->mode == CH_MODE_SHARED) {
+        shm_close(ch->shm);
+    } else {
+        // locked senders and receivers look at closed under the lock
+        lock(&ch->lock);
+        __atomic_store_n(&ch->closed, 1, __ATOMIC_SEQ_CST);
+        cond_signal(&ch->send_cond, INT_MAX);
+        cond_signal(&ch->recv_cond, INT_MAX);
+        unlock(&ch->lock);
+        if(ch->mode == CH_MODE_SPSC) {
+            spsc_close(ch->spsc);
+        } else if(ch->mode == CH_MODE_MPMC) {
+            mpmc_close(ch->mpmc);
+        } else if(ch->mode == CH_MODE_BROADCAST) {
+            bcast_close(ch->bcast);
+        } else if(ch->capacity == 0) {
+            rdv_close(ch);
         }
-        error = pthread_mutex_init(&recv_mutexes[i], NULL);
-        if(error < 0) {
-            printf("error initializing recv mutex %d\n", i);
+    }
+    notify_watchers(ch);
+    return 0;
+}
+
+/*
+ * Release.
+ */
+
+int ch_release(int channel) {
+    struct channel* ch;
+    int* ids;
+
+    lock(&table_lock);
+    ch = lookup(channel);
+    if(ch == NULL) {
+        unlock(&table_lock);
+        printf("You've tried to release a nonexistent channel.\n");
+        return -1;
+    }
+    // the executor may still hold on to it
+    if(ch->ext != NULL && (__atomic_load_n(&ch->ext->handler, __ATOMIC_ACQUIRE) != NULL ||
+                           __atomic_load_n(&ch->ext->queued, __ATOMIC_ACQUIRE))) {
+        unlock(&table_lock);
+        printf("channel %d still has a message handler\n", channel);
+        return -1;
+    }
+    // a shared channel's messages may be meant for other processes
+    if(ch->mode != CH_MODE_SHARED && pending(ch)) {
+        unlock(&table_lock);
+        printf("channel %d still holds messages\n", channel);
+        return -1;
+    }
+    if(n_free == free_size) {
+        ids = realloc(free_ids, (free_size ? 2 * free_size : CHUNK_SIZE) * sizeof(int));
+        if(ids == NULL) {
+            unlock(&table_lock);
+            printf("error allocating free channel list\n");
             return -1;
         }
-        error = pthread_cond_init(&send_cond[i], NULL);
-        if(error < 0) {
-            printf("error initializing send cond %d\n", i);
+        free_ids = ids;
+        free_size = free_size ? 2 * free_size : CHUNK_SIZE;
+    }
+    __atomic_store_n(&ch->open, 0, __ATOMIC_RELEASE);
+    free_queue(ch);
+    free_ext(ch);
+    free_ids[n_free++] = channel;
+    unlock(&table_lock);
+    return 0;
+}
+
+/*
+ * Slot access. slot_put and slot_take must be called with the channel's
+ * lock held. priority is 0 unless the channel is a priority channel.
+ */
+
+static int ch_full(struct channel* ch) {
+    return __atomic_load_n(&ch->count, __ATOMIC_ACQUIRE) >= ch->capacity;
+}
+
+static void slot_put(struct channel* ch, const char* msg, int priority) {
+    if(ch->mode == CH_MODE_PRIORITY) {
+        prio_put(ch, msg, priority);
+        return;
+    }
+    copy_msg((char*) ch->ring + ch->tail * ch->stride, msg, ch->size);
+    ch->tail = (ch->tail + 1) & (ch->capacity - 1);
+}
+
+static void slot_take(struct channel* ch, char* dest) {
+    if(ch->mode == CH_MODE_PRIORITY) {
+        prio_take(ch, dest);
+        return;
+    }
+    copy_msg(dest, (char*) ch->ring + ch->head * ch->stride, ch->size);
+    ch->head = (ch->head + 1) & (ch->capacity - 1);
+}
+
+/*
+ * Socket access. The messages themselves go over the wire: the pointers,
+ * not what they point to, or the values. These are called without the
+ * channel's lock, once the room or the messages have been claimed under
+ * it, so that a sender blocked on a full connection never keeps the
+ * receivers from draining it. write_lock and read_lock keep the bytes of
+ * concurrent senders and receivers from interleaving.
+ */
+
+static int socket_write(struct channel* ch, const char* msgs, int n) {
+    struct channel_ext* ext = ch->ext;
+    size_t done = 0;
+    ssize_t k;
+    lock(&ext->write_lock);
+    while(done < (size_t) n * ch->size) {
+        k = write(ext->write_fd, msgs + done, (size_t) n * ch->size - done);
+        if(k < 0 && errno != EINTR) {
+            unlock(&ext->write_lock);
+            perror("write");
+            printf("error writing to channel fd %d\n", ext->write_fd);
             return -1;
         }
-        error = pthread_cond_init(&recv_cond[i], NULL);
-        if(error < 0) {
-            printf("error initializing recv cond %d\n", i);
+        if(k > 0) {
+            done += k;
+        }
+    }
+    unlock(&ext->write_lock);
+    return 0;
+}
+
+static int socket_read(struct channel* ch, char* dest, int n) {
+    struct channel_ext* ext = ch->ext;
+    size_t done = 0;
+    ssize_t k;
+    lock(&ext->read_lock);
+    while(done < (size_t) n * ch->size) {
+        k = read(ext->read_fd, dest + done, (size_t) n * ch->size - done);
+        if(k == 0 || (k < 0 && errno != EINTR)) {
+            unlock(&ext->read_lock);
+            printf("error reading from channel fd %d\n", ext->read_fd);
             return -1;
         }
+        if(k > 0) {
+            done += k;
+        }
     }
-    
-    // initialise isMessage array to 0
-    bzero(isMessage, sizeof(isMessage));
-    
-    
+    unlock(&ext->read_lock);
     return 0;
 }
 
 /*
- * Destroy.
+ * Locked channels. Senders and receivers share the channel's one lock,
+ * which guards the ring and count and under which both sides check for
+ * room or messages, wait and signal, so no wake-up can slip in between a
+ * check and the wait that follows it. Each side wakes the other once per
+ * batch of messages. Spinning happens before taking the lock, so that the
+ * other side can get in meanwhile. Priority channels work the same way;
+ * only slot_put and slot_take know about their levels.
  */
 
-int ch_destroy() {
-	// clean up before closing program
-	// after calling this, not safe to use any channels functions
-	// return 0 on success or < 0 on error
-	// was ch_setup called earlier?
-	// is no one currently listening on any channels?
-    int error, i;
-    for(i = 0; i < CHANNELS; i++) {
-        error = close(new_fds[i]);
-        if(error < 0) {
+static int send_locked(struct channel* ch, const char* msgs, int n, int priority,
+                       const struct timespec* deadline) {
+    struct spin sp;
+    long began = 0;
+    int room, i, k;
+    int sent = 0;
+    if(ch_full(ch) && deadline != &no_wait) {
+        began = wait_mark(began, deadline);
+        spin_start(&sp, ch);
+        while(ch_full(ch) && spin_more(&sp)) {
+        }
+        spin_end(&sp, !ch_full(ch));
+    }
+    lock(&ch->lock);
+    while(sent < n && !ch->closed) {
+        while(ch_full(ch) && !ch->closed) {
+            began = wait_mark(began, deadline);
+            if(cond_wait(&ch->send_cond, &ch->lock, deadline) < 0) {
+                break;
+            }
+        }
+        if(ch->closed) {
+            break;
+        }
+        // critical section
+        room = ch->capacity - __atomic_load_n(&ch->count, __ATOMIC_ACQUIRE);
+        if(room <= 0) {
+            break;
+        }
+        k = room < n - sent ? room : n - sent;
+        if(backend == CH_BACKEND_MEMORY) {
+            for(i = 0; i < k; i++) {
+                slot_put(ch, msgs + (sent + i) * ch->size, priority);
+            }
+        }
+        __atomic_add_fetch(&ch->count, k, __ATOMIC_RELEASE);
+        // send signal, once for the whole batch
+        cond_signal(&ch->recv_cond, k);
+        notify_watchers(ch);
+        if(backend == CH_BACKEND_SOCKET) {
+            // the room is ours; receivers wait in read for the bytes
+            unlock(&ch->lock);
+            if(socket_write(ch, msgs + sent * ch->size, k) < 0) {
+                return -1;
+            }
+            lock(&ch->lock);
+        }
+        sent += k;
+    }
+    // unlock
+    unlock(&ch->lock);
+    wait_done(ch, SEND_SIDE, began);
+    return sent;
+}
+
+static int recv_locked(struct channel* ch, char* dest, int max,
+                       const struct timespec* deadline) {
+    struct spin sp;
+    long began = 0;
+    int avail, i, k;
+    if(__atomic_load_n(&ch->count, __ATOMIC_ACQUIRE) == 0 && deadline != &no_wait) {
+        began = wait_mark(began, deadline);
+        spin_start(&sp, ch);
+        while(__atomic_load_n(&ch->count, __ATOMIC_ACQUIRE) == 0 && spin_more(&sp)) {
+        }
+        spin_end(&sp, __atomic_load_n(&ch->count, __ATOMIC_ACQUIRE) > 0);
+    }
+    lock(&ch->lock);
+    // wait for message
+    while(__atomic_load_n(&ch->count, __ATOMIC_ACQUIRE) == 0 && !ch->closed) {
+        began = wait_mark(began, deadline);
+        if(cond_wait(&ch->recv_cond, &ch->lock, deadline) < 0) {
+            break;
+        }
+    }
+    // critical section
+    avail = __atomic_load_n(&ch->count, __ATOMIC_ACQUIRE);
+    k = avail < max ? avail : max;
+    if(backend == CH_BACKEND_MEMORY) {
+        for(i = 0; i < k; i++) {
+            slot_take(ch, dest + i * ch->size);
+        }
+    }
+    if(k > 0) {
+        __atomic_sub_fetch(&ch->count, k, __ATOMIC_RELEASE);
+        // send signal to producers, once for the whole batch
+        cond_signal(&ch->send_cond, k);
+        notify_watchers(ch);
+    }
+    // unlock
+    unlock(&ch->lock);
+    // the messages are ours, though they may still be on their way
+    if(backend == CH_BACKEND_SOCKET && k > 0 && socket_read(ch, dest, k) < 0) {
+        return -1;
+    }
+    wait_done(ch, RECV_SIDE, began);
+    return k;
+}
+
+/*
+ * Batches. Every send and receive goes through these two, which check the
+ * arguments and hand over to the channel's mode. They return how many
+ * messages were moved, which is less than asked for (0 for receives) only
+ * if the deadline passed or the channel was closed. Rather than 0 they
+ * return CH_CLOSED once the channel is closed, and for receives, drained.
+ * values tells whether the caller passes values or pointers, which has to
+ * match the channel. Sends on a priority channel take a priority.
+ */
+
+static int check_kind(struct channel* ch, int channel, int values) {
+    if(values && ch->value_size == 0) {
+        printf("channel %d carries pointers, not values\n", channel);
+        return -1;
+    }
+    if(!values && ch->value_size > 0) {
+        printf("channel %d carries values, not pointers\n", channel);
+        return -1;
+    }
+    return 0;
+}
+
+static int send_batch(int channel, const void* msgs, int n, int values, int priority,
+                      const struct timespec* deadline) {
+    struct channel* ch = lookup(channel);
+    int i, sent;
+    if(ch == NULL) {
+        printf("You've entered a nonexistent channel.\n");
+        return -1;
+    }
+    if(msgs == NULL || n < 0) {
+        printf("invalid batch for channel %d\n", channel);
+        return -1;
+    }
+    if(check_kind(ch, channel, values) < 0) {
+        return -1;
+    }
+    if(priority < 0 || priority >= CH_PRIORITIES ||
+       (priority > 0 && ch->mode != CH_MODE_PRIORITY)) {
+        printf("priority %d is out of range for channel %d\n", priority, channel);
+        return -1;
+    }
+    for(i = 0; !values && i < n; i++) {
+        if(((void* const*) msgs)[i] == NULL) {
+            printf("Message was null. Fix me.\n");
             return -1;
         }
-        error = close(socket_fds[i]);
-        if(error < 0) {
-            return -1;
+    }
+    if(ch_closed(ch)) {
+        return CH_CLOSED;
+    }
+    switch(ch->mode) {
+    case CH_MODE_SPSC:
+        sent = spsc_send_many(ch->spsc, (const char*) msgs, n, deadline);
+        break;
+    case CH_MODE_MPMC:
+        sent = mpmc_send_many(ch->mpmc, (const char*) msgs, n, deadline);
+        break;
+    case CH_MODE_SHARED:
+        sent = shm_send_many(ch, (void* const*) msgs, n, deadline);
+        break;
+    case CH_MODE_BROADCAST:
+        sent = bcast_publish(ch, (void* const*) msgs, n, deadline);
+        break;
+    default:
+        if(ch->capacity == 0) {
+            sent = rdv_send_many(ch, (const char*) msgs, n, deadline);
+            break;
         }
-        error = close(client_fds[i]);
-        if(error < 0) {
-            return -1;
+        sent = send_locked(ch, (const char*) msgs, n, priority, deadline);
+        break;
+    }
+    count_sent(ch, sent);
+    if(sent == 0 && n > 0 && ch_closed(ch)) {
+        return CH_CLOSED;
+    }
+    return sent;
+}
+
+static int recv_batch(int channel, void* dest, int max, int values,
+                      const struct timespec* deadline) {
+    struct channel* ch = lookup(channel);
+    int got;
+    if(ch == NULL) {
+        printf("you've entered a nonexistent channel\n");
+        return -1;
+    }
+    if(dest == NULL || max < 1) {
+        printf("invalid batch for channel %d\n", channel);
+        return -1;
+    }
+    if(check_kind(ch, channel, values) < 0) {
+        return -1;
+    }
+    if(ch->mode == CH_MODE_BROADCAST) {
+        printf("channel %d is a broadcast channel; receive with ch_recv_sub\n", channel);
+        return -1;
+    }
+    switch(ch->mode) {
+    case CH_MODE_SPSC:
+        got = spsc_recv_many(ch->spsc, (char*) dest, max, deadline);
+        break;
+    case CH_MODE_MPMC:
+        got = mpmc_recv_many(ch->mpmc, (char*) dest, max, deadline);
+        break;
+    case CH_MODE_SHARED:
+        got = shm_recv_many(ch, (void**) dest, max, deadline);
+        break;
+    default:
+        if(ch->capacity == 0) {
+            got = rdv_recv_many(ch, (char*) dest, max, deadline);
+            break;
         }
+        got = recv_locked(ch, (char*) dest, max, deadline);
+        break;
     }
-    return 0;
+    count_received(ch, got);
+    if(got == 0 && ch_closed(ch) && !pending(ch)) {
+        return CH_CLOSED;
+    }
+    return got;
 }
 
 /*
@@ -224,50 +3152,39 @@ int ch_send(int channel, void* msg) {
 	// returns 0 on success and < 0 on error
 	// message CANNOT be NULL
 		// is no one currently listening on any channels?
-    int error;
-    if(msg == NULL) {
-        printf("Message was null. Fix me.\n");
-        return -1;
-    } else if(channel > 7) {
-        printf("You've entered a nonexistent channel.\n");
-        return -1;
-    } else {
-        error = pthread_mutex_lock(&send_mutexes[channel]);
-        if(error < 0) {
-            printf("error locking in send with %d\n", channel);
-            return -1;
-        }
-        while(ch_peek(channel) == 1) {
-            error = pthread_cond_wait(&send_cond[channel], &send_mutexes[channel]);
-            if(error < 0) {
-                printf("error waiting in send with %d\n", channel);
-                return -1;
-            }
-        }
-        // critical section
-        error = write(fds[channel+8].fd, msg, sizeof(msg));
-        if(error < 0) {
-            perror("write");
-            printf("%s\n", (char *)perror);
-            printf("error writing to channel %d\n", channel);
-            return -1;
-        }
-        isMessage[channel] = 1;
-        // send signal
-        error = pthread_cond_signal(&recv_cond[channel]);
-        if(error < 0) {
-            printf("error signaling from send on channel %d\n", channel);
-            return -1;
-        }
-        // unlock
-        error = pthread_mutex_unlock(&send_mutexes[channel]);
-        if(error < 0) {
-            printf("error unlocking in channel %d\n", channel);
-            return -1;
-        }
+    int sent = send_batch(channel, &msg, 1, 0, 0, NULL);
+    return sent < 0 ? sent : 0;
+}
+
+int ch_send_priority(int channel, void* msg, int priority) {
+    int sent = send_batch(channel, &msg, 1, 0, priority, NULL);
+    return sent < 0 ? sent : 0;
+}
+
+int ch_send_many(int channel, void** msgs, int n) {
+    return send_batch(channel, msgs, n, 0, 0, NULL);
+}
+
+int ch_send_timeout(int channel, void* msg, int timeout) {
+    struct timespec deadline;
+    int sent;
+    if(timeout < 0) {
+        return ch_send(channel, msg);
     }
-    return 0;
+    deadline_in(&deadline, timeout);
+    sent = send_batch(channel, &msg, 1, 0, 0, &deadline);
+    if(sent < 0) {
+        return sent;
+    }
+    return sent == 1 ? 0 : CH_TIMEOUT;
+}
+
+/*
+ * Try to send.
+ */
 
+int ch_trysend(int channel, void* msg) {
+    return send_batch(channel, &msg, 1, 0, 0, &no_wait);
 }
 
 /*
@@ -283,50 +3200,29 @@ int ch_recv(int channel, void** dest) {
 	// returns 0 on success and < 0 on error
 	// in case of error, *dest set to NULL
 		// is no one currently listening on any channels?
-    *dest = malloc(sizeof(dest));
-    if(*dest < 0) {
-        printf("error mallocing\n");
-        return -1;
+    int got = recv_batch(channel, dest, 1, 0, NULL);
+    if(got < 0) {
+        *dest = NULL;
+        return got;
     }
-    int err;
-    if(channel < CHANNELS) {
-        // lock
-        err = pthread_mutex_lock(&recv_mutexes[channel]);
-        if(err < 0) {
-            printf("error locking on channel %d in recv\n", channel);
-            return -1;
-        }
-        // wait for message
-        while(ch_peek(channel) == 0) {
-            err = pthread_cond_wait(&recv_cond[channel], &recv_mutexes[channel]);
-            if(err < 0) {
-                printf("error waiting on channel %d in recv\n", channel);
-                return -1;
-            }
-        }
-        // critical section
-        n = read(fds[channel+16].fd, *dest, sizeof(dest));
-        if(n < 0) {
-            printf("error reading from channel %d\n", channel);
-            return -1;
-        }
-        isMessage[channel] = 0;
-        // send signal to producer
-        err = pthread_cond_signal(&send_cond[channel]);
-        if(err < 0) {
-            printf("error signaling from recv on channel %d\n", channel);
-            return -1;
-        }
-        // unlock
-        err = pthread_mutex_unlock(&recv_mutexes[channel]);
-        if(err < 0) {
-            printf("error unlocking in channel %d in recv\n", channel);
-            return -1;
-        }
-    } else {
-        printf("you've entered a nonexistent channel\n");
+    return 0;
+}
+
+int ch_recv_many(int channel, void** dest, int max) {
+    return recv_batch(channel, dest, max, 0, NULL);
+}
+
+int ch_recv_timeout(int channel, void** dest, int timeout) {
+    struct timespec deadline;
+    int got;
+    if(timeout < 0) {
+        return ch_recv(channel, dest);
+    }
+    deadline_in(&deadline, timeout);
+    got = recv_batch(channel, dest, 1, 0, &deadline);
+    if(got <= 0) {
         *dest = NULL;
-        return -1;
+        return got < 0 ? got : CH_TIMEOUT;
     }
     return 0;
 }
@@ -342,49 +3238,244 @@ int ch_tryrecv(int channel, void** dest) {
 	// if msg retrieved
 		// return 1 and *dest set to msg
 		// is no one currently listening on any channels?
-    // if there is no msg
-    int err;
-    *dest = malloc(sizeof(dest));
-    if(*dest < 0) {
-        printf("error mallocing\n");
+    int got = recv_batch(channel, dest, 1, 0, &no_wait);
+    if(got <= 0) {
+        *dest = NULL;
+    }
+    return got;
+}
+
+/*
+ * Values.
+ */
+
+int ch_send_value(int channel, const void* value) {
+    int sent = send_batch(channel, value, 1, 1, 0, NULL);
+    return sent < 0 ? sent : 0;
+}
+
+int ch_recv_value(int channel, void* dest) {
+    int got = recv_batch(channel, dest, 1, 1, NULL);
+    return got < 0 ? got : 0;
+}
+
+/*
+ * Broadcast.
+ */
+
+static struct channel* lookup_broadcast(int channel) {
+    struct channel* ch = lookup(channel);
+    if(ch == NULL) {
+        printf("You've entered a nonexistent channel.\n");
+        return NULL;
+    }
+    if(ch->mode != CH_MODE_BROADCAST) {
+        printf("channel %d is not a broadcast channel\n", channel);
+        return NULL;
+    }
+    return ch;
+}
+
+static struct bcast_sub* lookup_sub(struct channel* ch, int channel, int sub) {
+    struct bcast_sub* s = NULL;
+    if(sub >= 0 && sub < CH_MAX_SUBSCRIBERS) {
+        s = __atomic_load_n(&ch->bcast->subs[sub], __ATOMIC_ACQUIRE);
+    }
+    if(s == NULL) {
+        printf("channel %d has no subscription %d\n", channel, sub);
+    }
+    return s;
+}
+
+int ch_publish(int channel, void* msg) {
+    if(lookup_broadcast(channel) == NULL) {
+        return -1;
+    }
+    return ch_send(channel, msg);
+}
+
+int ch_subscribe(int channel) {
+    struct channel* ch = lookup_broadcast(channel);
+    struct bcast_sub* s;
+    int i;
+
+    if(ch == NULL) {
+        return -1;
+    }
+    if(posix_memalign((void**) &s, CACHE_LINE, sizeof(*s)) != 0) {
+        printf("error allocating subscription for channel %d\n", channel);
+        return -1;
+    }
+    bzero(s, sizeof(*s));
+    lock(&ch->lock);
+    for(i = 0; i < CH_MAX_SUBSCRIBERS && ch->bcast->subs[i] != NULL; i++) {
+    }
+    if(i == CH_MAX_SUBSCRIBERS) {
+        unlock(&ch->lock);
+        free(s);
+        printf("channel %d has too many subscriptions\n", channel);
+        return -1;
+    }
+    // it sees what is published from now on
+    s->cursor = ch->bcast->tail;
+    __atomic_store_n(&ch->bcast->subs[i], s, __ATOMIC_RELEASE);
+    ch->bcast->n_subs++;
+    unlock(&ch->lock);
+    return i;
+}
+
+int ch_unsubscribe(int channel, int sub) {
+    struct channel* ch = lookup_broadcast(channel);
+    struct bcast_sub* s;
+    unsigned int seq;
+
+    if(ch == NULL || (s = lookup_sub(ch, channel, sub)) == NULL) {
+        return -1;
+    }
+    lock(&ch->lock);
+    ch->bcast->subs[sub] = NULL;
+    ch->bcast->n_subs--;
+    // let go of everything it still had to read, so that publishers no
+    // longer wait for it
+    for(seq = s->cursor - s->held; seq != ch->bcast->tail; seq++) {
+        bcast_pass(ch, seq);
+    }
+    unlock(&ch->lock);
+    free(s);
+    return 0;
+}
+
+int ch_recv_sub(int channel, int sub, void** dest, int timeout) {
+    struct channel* ch = lookup_broadcast(channel);
+    struct bcast_sub* s;
+    struct timespec deadline;
+    int got;
+
+    if(ch == NULL || (s = lookup_sub(ch, channel, sub)) == NULL || dest == NULL) {
+        if(dest != NULL) {
+            *dest = NULL;
+        }
         return -1;
     }
-    if(ch_peek(channel) == 0) {
+    if(timeout > 0) {
+        deadline_in(&deadline, timeout);
+    }
+    got = bcast_recv(ch, s, dest, timeout < 0 ? NULL : timeout == 0 ? &no_wait : &deadline);
+    count_received(ch, got);
+    if(got <= 0) {
         *dest = NULL;
-        return 0;
-    // if there is a msg
-    } else if(ch_peek(channel) == 1) {
-        // lock
-        err = pthread_mutex_lock(&recv_mutexes[channel]);
-        if(err < 0) {
-            printf("error locking on channel %d in try_recv\n", channel);
-            return -1;
+        return got < 0 ? got : CH_TIMEOUT;
+    }
+    return 0;
+}
+
+/*
+ * Select.
+ */
+
+static int ch_room(struct channel* ch) {
+    switch(ch->mode) {
+    case CH_MODE_SPSC:
+        return spsc_room(ch->spsc);
+    case CH_MODE_MPMC:
+        return !mpmc_full(ch->mpmc);
+    case CH_MODE_SHARED:
+        return __atomic_load_n(&ch->shm->count, __ATOMIC_ACQUIRE) < ch->capacity;
+    case CH_MODE_BROADCAST:
+        return __atomic_load_n(&ch->bcast->refs[__atomic_load_n(&ch->bcast->tail, __ATOMIC_RELAXED) &
+                                                 (ch->capacity - 1)], __ATOMIC_ACQUIRE) == 0;
+    default:
+        if(ch->capacity == 0) {
+            return __atomic_load_n(&ch->rdv->receivers.n, __ATOMIC_ACQUIRE) > 0;
         }
-        // critical section
-        n = read(fds[channel+16].fd, *dest, sizeof(dest));
-        if(n < 0) {
-            printf("error reading from channel %d\n", channel);
+        return !ch_full(ch);
+    }
+}
+
+/*
+ * A closed channel is ready both ways, since sending or receiving on it no
+ * longer blocks.
+ */
+static int select_scan(ch_selector* sel, struct channel** chs, int n) {
+    int i, closed, ready = 0;
+    for(i = 0; i < n; i++) {
+        sel[i].revents = 0;
+        closed = ch_closed(chs[i]);
+        if((sel[i].events & CH_SELECT_RECV) && (closed || pending(chs[i]))) {
+            sel[i].revents |= CH_SELECT_RECV;
+        }
+        if((sel[i].events & CH_SELECT_SEND) && (closed || ch_room(chs[i]))) {
+            sel[i].revents |= CH_SELECT_SEND;
+        }
+        if(sel[i].revents) {
+            ready++;
+        }
+    }
+    return ready;
+}
+
+int ch_select(ch_selector* sel, int n, int timeout) {
+    struct ch_waiter waiter;
+    struct watch_node* nodes;
+    struct channel** chs;
+    struct timespec deadline;
+    unsigned int seen;
+    int i, ready;
+
+    if(sel == NULL || n < 1) {
+        printf("nothing to select on\n");
+        return -1;
+    }
+    nodes = calloc(n, sizeof(struct watch_node) + sizeof(struct channel*));
+    if(nodes == NULL) {
+        printf("error allocating watchers\n");
+        return -1;
+    }
+    chs = (struct channel**) (nodes + n);
+    for(i = 0; i < n; i++) {
+        chs[i] = lookup(sel[i].channel);
+        if(chs[i] == NULL) {
+            printf("You've tried to select on a nonexistent channel.\n");
+            free(nodes);
             return -1;
         }
-        isMessage[channel] = 0;
-        // send signal to producer
-        err = pthread_cond_signal(&send_cond[channel]);
-        if(err < 0) {
-            printf("error signaling from recv on channel %d\n", channel);
+        if(chs[i]->mode == CH_MODE_BROADCAST && (sel[i].events & CH_SELECT_RECV)) {
+            printf("subscribers of broadcast channel %d wait in ch_recv_sub\n", sel[i].channel);
+            free(nodes);
             return -1;
         }
-        // unlock
-        err = pthread_mutex_unlock(&recv_mutexes[channel]);
-        if(err < 0) {
-            printf("error unlocking in channel %d in recv\n", channel);
+        if(ext_of(chs[i]) == NULL) {
+            printf("error allocating channel %d\n", sel[i].channel);
+            free(nodes);
             return -1;
         }
-        return 1;
-    } else {
-        printf("an error occurred in peek somewhere\n");
-        return -1;
     }
-	
+
+    deadline_in(&deadline, timeout > 0 ? timeout : 0);
+
+    waiter.seq = 0;
+    for(i = 0; i < n; i++) {
+        nodes[i].waiter = &waiter;
+        watch(chs[i], &nodes[i]);
+    }
+    fence_after_register();
+
+    for(;;) {
+        // read seq before looking at the channels, so a change that we
+        // miss in the scan is guaranteed to have bumped it afterwards
+        seen = __atomic_load_n(&waiter.seq, __ATOMIC_ACQUIRE);
+        ready = select_scan(sel, chs, n);
+        if(ready > 0 || (timeout >= 0 && expired(&deadline))) {
+            break;
+        }
+        futex_wait_until(&waiter.seq, seen, timeout < 0 ? NULL : &deadline);
+    }
+
+    for(i = 0; i < n; i++) {
+        unwatch(chs[i], &nodes[i]);
+    }
+    free(nodes);
+    return ready;
 }
 
 /*
@@ -397,36 +3488,280 @@ int ch_peek(int channel) {
 	// return 1 if currently pending msg, 0 if not
 	// -1 in case of errors
 		// is no one currently listening on any channels?
-    
-    int avail = 0;
-    
+    struct channel* ch = lookup(channel);
+
     // double check that they entered the correct channel #
-    if(channel > 7) {
+    if(ch == NULL) {
         printf("You've tried to peek a nonexistent channel.\n");
         return -1;
     }
-    
-    // double check that there are listening sockets
-    for(int i = 0; i < 8; i++) {
-        if(fds[i].fd > 0) {
-            avail = avail + 1;
-        }
+    return pending(ch);
+}
+
+int ch_depth(int channel) {
+    struct channel* ch = lookup(channel);
+    if(ch == NULL) {
+        printf("You've asked for the depth of a nonexistent channel.\n");
+        return -1;
     }
-    
-    // if there are sockets listening
-    if(avail > 0) {
-        if(isMessage[channel]) {
-            return 1;
-        } else {
-            return 0;
+    return depth(ch);
+}
+
+int ch_capacity(int channel) {
+    struct channel* ch = lookup(channel);
+    if(ch == NULL) {
+        printf("You've asked for the capacity of a nonexistent channel.\n");
+        return -1;
+    }
+    return ch->capacity;
+}
+
+/*
+ * File descriptors.
+ */
+
+int ch_fd(int channel) {
+    struct channel* ch = lookup(channel);
+    struct channel_ext* ext;
+    int fd;
+
+    if(ch == NULL) {
+        printf("You've tried to get the descriptor of a nonexistent channel.\n");
+        return -1;
+    }
+    if(ch->mode == CH_MODE_BROADCAST) {
+        printf("subscribers of broadcast channel %d receive with ch_recv_sub\n", channel);
+        return -1;
+    }
+    ext = ext_of(ch);
+    if(ext == NULL) {
+        printf("error allocating channel %d\n", channel);
+        return -1;
+    }
+    lock(&ext->watch_lock);
+    if(ext->event_fd < 0) {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(fd < 0) {
+            unlock(&ext->watch_lock);
+            printf("error creating eventfd for channel %d: %s\n", channel, strerror(errno));
+            return -1;
         }
-    } else {
-        printf("There are no listening sockets available.\n");
+        ext->event_fd = fd;
+        ext->event_ready = 0;
+        // from now on every change reaches sync_event_fd; pairs with the
+        // fence in notify_watchers for changes made before
+        __atomic_add_fetch(&ch->watch_count, 1, __ATOMIC_SEQ_CST);
+        sync_event_fd(ch);
+    }
+    fd = ext->event_fd;
+    unlock(&ext->watch_lock);
+    return fd;
+}
+
+/*
+ * Stats.
+ */
+
+int ch_stats(int channel, ch_metrics* out) {
+    struct channel* ch = lookup(channel);
+    struct metrics* m;
+    int i;
+    if(ch == NULL) {
+        printf("You've asked for stats of a nonexistent channel.\n");
+        return -1;
+    }
+    if(out == NULL) {
+        printf("invalid stats buffer for channel %d\n", channel);
         return -1;
     }
+    if(!STATS) {
+        printf("channel statistics were compiled out\n");
+        return -1;
+    }
+    out->sent = __atomic_load_n(&ch->sent, __ATOMIC_RELAXED);
+    out->received = __atomic_load_n(&ch->received, __ATOMIC_RELAXED);
+    out->depth = depth(ch);
+    out->high_water = __atomic_load_n(&ch->high_water, __ATOMIC_RELAXED);
+    // no histograms yet if no-one has had to wait
+    m = ch->ext != NULL ? __atomic_load_n(&ch->ext->metrics, __ATOMIC_ACQUIRE) : NULL;
+    if(m == NULL) {
+        bzero(out->send_waits, sizeof(out->send_waits));
+        bzero(out->recv_waits, sizeof(out->recv_waits));
+        out->send_wait_ns = 0;
+        out->recv_wait_ns = 0;
+        return 0;
+    }
+    out->send_wait_ns = __atomic_load_n(&m->send_wait_ns, __ATOMIC_RELAXED);
+    out->recv_wait_ns = __atomic_load_n(&m->recv_wait_ns, __ATOMIC_RELAXED);
+    for(i = 0; i < CH_STATS_BUCKETS; i++) {
+        out->send_waits[i] = __atomic_load_n(&m->send_waits[i], __ATOMIC_RELAXED);
+        out->recv_waits[i] = __atomic_load_n(&m->recv_waits[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/*
+ * Message handlers.
+ */
+
+/*
+ * Called once ext_of(ch) has succeeded.
+ */
+static void set_handler(struct channel* ch, int channel, ch_handler fn, void* ctx) {
+    struct channel_ext* ext = ch->ext;
+    ch_handler old;
+    lock(&ext->watch_lock);
+    old = ext->handler;
+    ext->number = channel;
+    __atomic_store_n(&ext->handler_ctx, ctx, __ATOMIC_RELAXED);
+    __atomic_store_n(&ext->handler, fn, __ATOMIC_RELEASE);
+    // notify_watchers only looks for a handler while watch_count is set
+    if(old == NULL && fn != NULL) {
+        __atomic_add_fetch(&ch->watch_count, 1, __ATOMIC_SEQ_CST);
+    } else if(old != NULL && fn == NULL) {
+        __atomic_sub_fetch(&ch->watch_count, 1, __ATOMIC_RELAXED);
+    }
+    unlock(&ext->watch_lock);
+}
+
+/*
+ * Hands up to HANDLER_BATCH messages to the channel's handler, then puts
+ * the channel back on the ready list if it has more, so that one busy
+ * channel cannot starve the others. Only the thread that took the channel
+ * off the list runs its handler, which keeps its messages in order.
+ */
+static void run_handler(struct channel* ch) {
+    char value[CH_MAX_VALUE_SIZE] __attribute__((aligned(16)));
+    void* msgs[HANDLER_BATCH];
+    struct channel_ext* ext = ch->ext;
+    ch_handler fn = __atomic_load_n(&ext->handler, __ATOMIC_ACQUIRE);
+    void* ctx = __atomic_load_n(&ext->handler_ctx, __ATOMIC_RELAXED);
+    int channel = ext->number;
+    int got = 0, i;
+
+    if(fn != NULL && ch->value_size > 0) {
+        for(got = 0; got < HANDLER_BATCH; got++) {
+            i = recv_batch(channel, value, 1, 1, &no_wait);
+            if(i <= 0) {
+                got = got > 0 ? got : i;
+                break;
+            }
+            fn(channel, value, ctx);
+        }
+    } else if(fn != NULL) {
+        got = recv_batch(channel, msgs, HANDLER_BATCH, 0, &no_wait);
+        for(i = 0; i < got; i++) {
+            fn(channel, msgs[i], ctx);
+        }
+    }
+    if(got == CH_CLOSED) {
+        // the last call may release the channel, so let go of it first
+        set_handler(ch, channel, NULL, NULL);
+        __atomic_store_n(&ext->queued, 0, __ATOMIC_SEQ_CST);
+        fn(channel, NULL, ctx);
+        return;
+    }
+    // pairs with the fence in notify_watchers: either the sender sees the
+    // channel is no longer queued or we see its message
+    __atomic_store_n(&ext->queued, 0, __ATOMIC_SEQ_CST);
+    if(got >= 0 && __atomic_load_n(&ext->handler, __ATOMIC_ACQUIRE) != NULL &&
+       (pending(ch) || ch_closed(ch))) {
+        queue_ready(ch);
+    }
+}
 
+static void* execute(void* arg) {
+    struct channel* ch;
+    for(;;) {
+        lock(&ready_lock);
+        while(ready_head == NULL && !executors_stopping) {
+            cond_wait(&ready_cond, &ready_lock, NULL);
+        }
+        if(executors_stopping) {
+            unlock(&ready_lock);
+            return NULL;
+        }
+        ch = ready_head;
+        ready_head = ch->ext->ready_next;
+        if(ready_head == NULL) {
+            ready_tail = NULL;
+        }
+        unlock(&ready_lock);
+        run_handler(ch);
+    }
+}
 
+int ch_on_message(int channel, ch_handler fn, void* ctx) {
+    struct channel* ch = lookup(channel);
+    if(ch == NULL) {
+        printf("You've tried to handle a nonexistent channel.\n");
+        return -1;
+    }
+    if(ch->mode == CH_MODE_BROADCAST) {
+        printf("subscribers of broadcast channel %d receive with ch_recv_sub\n", channel);
+        return -1;
+    }
+    if(ext_of(ch) == NULL) {
+        printf("error allocating channel %d\n", channel);
+        return -1;
+    }
+    set_handler(ch, channel, fn, ctx);
+    // messages sent before the handler was in place found no-one to queue
+    // the channel
+    fence_after_register();
+    if(fn != NULL && (pending(ch) || ch_closed(ch))) {
+        queue_ready(ch);
+    }
+    return 0;
 }
 
+int ch_executor_start(int threads) {
+    int i;
+    if(n_executors > 0) {
+        printf("the executor is already running\n");
+        return -1;
+    }
+    if(threads < 0) {
+        printf("invalid number of executor threads %d\n", threads);
+        return -1;
+    }
+    if(threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = threads > 0 ? threads : 1;
+    }
+    executors = malloc(threads * sizeof(pthread_t));
+    if(executors == NULL) {
+        printf("error allocating executor threads\n");
+        return -1;
+    }
+    executors_stopping = 0;
+    for(i = 0; i < threads; i++) {
+        if(pthread_create(&executors[i], NULL, execute, NULL) != 0) {
+            printf("error creating executor thread\n");
+            n_executors = i;
+            ch_executor_stop();
+            return -1;
+        }
+    }
+    n_executors = threads;
+    return 0;
+}
 
- 
+int ch_executor_stop() {
+    int i;
+    if(executors == NULL) {
+        printf("the executor is not running\n");
+        return -1;
+    }
+    lock(&ready_lock);
+    executors_stopping = 1;
+    cond_signal(&ready_cond, INT_MAX);
+    unlock(&ready_lock);
+    for(i = 0; i < n_executors; i++) {
+        pthread_join(executors[i], NULL);
+    }
+    free(executors);
+    executors = NULL;
+    n_executors = 0;
+    return 0;
+}
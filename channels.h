@@ -4,10 +4,36 @@
    You may use additional .c and header (.h) files, in which case you also
    need to adapt the makefile.
    
-   In all the following, you can assume that the channel number will be in
-   the range 0-7 so you can just deal with a fixed number of channels.
+   Channels 0 to CH_DEFAULT_CHANNELS - 1 are opened by ch_setup. Any other
+   channel number has to be opened with ch_open before it can be used.
 */
 
+/*
+ * Error codes. Functions that return < 0 on error return CH_ERROR unless
+ * stated otherwise.
+ * CH_TIMEOUT = a timed operation ran out of time.
+ * CH_CLOSED = the channel was closed by ch_close. Sends fail with it right
+ * away, receives once every message sent before the close was received.
+ */
+#define CH_ERROR (-1)
+#define CH_TIMEOUT (-2)
+#define CH_CLOSED (-3)
+
+/*
+ * Number of channels opened by ch_setup.
+ */
+#define CH_DEFAULT_CHANNELS 8
+
+/*
+ * Channel numbers range from 0 to CH_MAX_CHANNELS - 1.
+ */
+#define CH_MAX_CHANNELS (1 << 20)
+
+/*
+ * Pass as the channel number to ch_open to get a new channel.
+ */
+#define CH_NEW (-1)
+
 /*
  * Must be called exactly once before using any channels.
  * returns 0 on success or < 0 on error, in which case it is not safe
@@ -16,8 +42,31 @@
 int ch_setup();
 
 /*
- * Function to clean up before closing the program. After calling this,
- * it is not safe to use any channels functions.
+ * Channel backends, selected once at set up time.
+ *
+ * CH_BACKEND_MEMORY hands each message over through an in-process slot
+ * guarded by the channel's own locks; no system calls are made on send or
+ * receive. This is the default.
+ *
+ * CH_BACKEND_SOCKET passes each message through a loopback TCP connection
+ * per channel, made on an ephemeral port when the channel is opened.
+ */
+enum ch_backend {
+    CH_BACKEND_MEMORY,
+    CH_BACKEND_SOCKET
+};
+
+/*
+ * Like ch_setup, but selects the backend to use. ch_setup() is the same
+ * as ch_setup_backend(CH_BACKEND_MEMORY).
+ * returns 0 on success or < 0 on error.
+ */
+int ch_setup_backend(int backend);
+
+/*
+ * Function to clean up before closing the program. Stops the executor if
+ * it is running. After calling this, it is not safe to use any channels
+ * functions.
  * returns 0 on success or < 0 on error.
  *
  * Precondtions: ch_setup() was called earlier and no-one is currently
@@ -25,42 +74,378 @@ int ch_setup();
  */
 int ch_destroy();
 
+/*
+ * Largest ring capacity a channel can be opened with.
+ */
+#define CH_MAX_CAPACITY (1 << 20)
+
+/*
+ * Largest value a value channel can carry.
+ */
+#define CH_MAX_VALUE_SIZE 1024
+
+/*
+ * Spin limit picked by the library: 256 rounds on machines with more than
+ * one CPU, which is one to a dozen microseconds depending on how long the
+ * CPU's pause instruction takes, and none otherwise.
+ */
+#define CH_SPIN_DEFAULT (-1)
+
+/*
+ * Channel modes, selected when a channel is opened.
+ *
+ * CH_MODE_LOCKED is the default and allows any number of senders and
+ * receivers.
+ *
+ * CH_MODE_SPSC is a lock-free queue for exactly one sending thread and one
+ * receiving thread. Neither side takes a lock; a thread only sleeps, on a
+ * futex, when the queue is empty or full. Requires the memory backend.
+ *
+ * CH_MODE_MPMC is a lock-free queue for any number of senders and receivers
+ * that scales better than CH_MODE_LOCKED when many threads compete on the
+ * same channel. Needs a capacity of at least 2 and the memory backend.
+ *
+ * CH_MODE_SHARED is a channel between processes, kept in the POSIX shared
+ * memory object called name (see shm_open). Every process opens it with
+ * the same name, capacity and msg_size; the first one creates it and the
+ * last one to release it removes it. Messages must come from ch_msg_alloc
+ * on the channel, which hands out blocks of the shared memory, so they
+ * are passed between processes without being copied; the receiver frees
+ * them with ch_msg_free. At most 2 * capacity messages can be allocated
+ * at a time, after which ch_msg_alloc waits for one to be freed.
+ * ch_select only notices messages sent by the calling process. Needs the
+ * memory backend.
+ *
+ * CH_MODE_PRIORITY is like CH_MODE_LOCKED, but every message has a
+ * priority from 0 to CH_PRIORITIES - 1, given to ch_send_priority, and
+ * receivers always get the oldest message of the highest priority
+ * pending. ch_send and the other sends use priority 0. Sending and
+ * receiving take constant time; the ring takes CH_PRIORITIES times the
+ * memory of a locked channel's. Needs the memory backend.
+ *
+ * CH_MODE_BROADCAST delivers every message to every subscription: a
+ * subscriber calls ch_subscribe once and then receives with ch_recv_sub,
+ * while ch_publish (or any send) puts a message in the one ring all of
+ * them read, so fanning out to K subscribers costs a single write. The
+ * subscribers share the message rather than own it; the library releases
+ * it, with ch_msg_free if the channel was opened with a msg_size and
+ * free() otherwise, once every subscription has moved past it. A
+ * publisher waits while the slowest subscription is capacity messages
+ * behind. Carries pointers only, and subscribers cannot use ch_recv,
+ * ch_select, ch_fd or ch_on_message on it. Needs the memory backend.
+ */
+enum ch_mode {
+    CH_MODE_LOCKED,
+    CH_MODE_SPSC,
+    CH_MODE_MPMC,
+    CH_MODE_SHARED,
+    CH_MODE_PRIORITY,
+    CH_MODE_BROADCAST
+};
+
+/*
+ * Number of priority levels of a CH_MODE_PRIORITY channel.
+ */
+#define CH_PRIORITIES 8
+
+/*
+ * Attributes of a channel, passed to ch_open.
+ * capacity = number of messages the channel can hold before ch_send blocks.
+ * Must be a power of two, or 0 for a rendezvous channel, on which every
+ * send waits until a receiver takes its message. A sender or receiver that
+ * comes first parks, and its partner hands the message straight to or
+ * from it and wakes only that thread; there is no slot in between.
+ * Capacity 0 needs CH_MODE_LOCKED and the memory backend. Defaults to 1.
+ * mode = one of enum ch_mode. Defaults to CH_MODE_LOCKED.
+ * msg_size = if not 0, the channel gets a pool of messages of this many
+ * bytes, handed out by ch_msg_alloc. Defaults to 0.
+ * value_size = if not 0, the channel carries values of this many bytes
+ * instead of pointers; see ch_send_value. At most CH_MAX_VALUE_SIZE.
+ * Defaults to 0.
+ * spin = how many rounds a thread that has to wait on the channel may
+ * spin before it yields and then sleeps. Within this limit the channel
+ * adapts the spinning to how long waits on it have recently taken. 0 to
+ * sleep right away. Defaults to CH_SPIN_DEFAULT.
+ * name = the name of the shared memory object of a CH_MODE_SHARED channel,
+ * e.g. "/jobs". Defaults to NULL.
+ */
+typedef struct {
+    int capacity;
+    int mode;
+    int msg_size;
+    int value_size;
+    int spin;
+    const char* name;
+} ch_attr;
+
+/*
+ * Fills attr with the defaults used by ch_setup for every channel.
+ */
+void ch_attr_init(ch_attr* attr);
+
+/*
+ * Opens a channel with the given attributes. attr may be NULL for the
+ * defaults. Messages are delivered in FIFO order.
+ * channel = the channel number to open, or CH_NEW to open a channel on
+ * an unused number. A channel that is already open is reopened with the
+ * new attributes, which also undoes a ch_close.
+ * returns the channel number on success and < 0 on error.
+ *
+ * Preconditions: ch_setup() was called earlier. When reopening, the
+ * channel is empty and no-one is currently sending or receiving on it.
+ */
+int ch_open(int channel, const ch_attr* attr);
+
+/*
+ * Closes a channel: nothing more can be sent on it, and every thread
+ * blocked on it in a send, receive or ch_select wakes up at once.
+ * Senders get CH_CLOSED; receivers first get the messages still in the
+ * channel and then CH_CLOSED, so a single call shuts down however many
+ * threads read from it. Closing a closed channel does nothing. A
+ * CH_MODE_SHARED channel is closed for every process that has it open.
+ * The channel keeps its number until ch_release.
+ * returns 0 on success and < 0 on error.
+ *
+ * Preconditions: the sends meant to be delivered have returned. A send
+ * racing with ch_close may fail, or succeed without being received.
+ */
+int ch_close(int channel);
+
+/*
+ * Releases a channel so that its number can be handed out again by
+ * ch_open(CH_NEW, ...).
+ * returns 0 on success and < 0 on error, e.g. if the channel still
+ * holds messages or has a message handler.
+ *
+ * Preconditions: no-one is currently sending or receiving on the
+ * channel, for instance because it was closed and they all got CH_CLOSED.
+ */
+int ch_release(int channel);
+
+/*
+ * Allocates a message from the pool of a channel that was opened with a
+ * msg_size. Each thread allocates from blocks of its own and only touches
+ * shared state when it runs out, so this is much cheaper than malloc when
+ * one thread allocates the messages that another one frees.
+ * returns the message, msg_size bytes aligned like malloc's, or NULL on
+ * error, e.g. once a CH_MODE_SHARED channel is closed.
+ *
+ * Preconditions: the channel stays open while the message is in use. A
+ * channel's pool, and every message allocated from it, is released when
+ * the channel is released or reopened with a different msg_size.
+ */
+void* ch_msg_alloc(int channel);
+
+/*
+ * Returns a message allocated by ch_msg_alloc to its pool. Any thread may
+ * free a message; one allocated by another thread is passed back to it in
+ * batches. msg may be NULL.
+ */
+void ch_msg_free(void* msg);
+
+/*
+ * returns 1 if the channel has a message pool, because it was opened with
+ * a msg_size or is a CH_MODE_SHARED one, 0 if it has not, and < 0 on
+ * error.
+ */
+int ch_has_pool(int channel);
+
 /*
  * Sends a message on a channel. Each channel has a capacity of one
- * message so if there is no message currently pending in the channel,
- * the send function must not wait for the message to be received.
- * If there is already a message in the channel that has not been delivered,
- * ch_send blocks until the first message has been delivered.
+ * message unless it was opened with a larger one, so if the channel is not
+ * full the send function must not wait for the message to be received.
+ * If the channel is full, ch_send blocks until the oldest message has
+ * been delivered.
  *
  * channel = the channel number.
  * msg = the message to send. By sending a message, the caller transfers
  * ownership of the message to the channel. Messages must be on the heap.
- * returns 0 on success and < 0 on error.
+ * returns 0 on success, CH_CLOSED if the channel was closed, in which case
+ * the caller still owns msg, and CH_ERROR on other errors.
  *
  * Preconditions: Message cannot be NULL.
  */
 int ch_send(int channel, void* msg);
 
+/*
+ * Like ch_send, but gives up if the channel is still full after timeout
+ * milliseconds, measured on CLOCK_MONOTONIC from the call. A timeout < 0
+ * waits for as long as it takes.
+ * returns 0 on success, CH_TIMEOUT if the time ran out, in which case the
+ * caller still owns msg, CH_CLOSED as for ch_send and CH_ERROR on other
+ * errors.
+ */
+int ch_send_timeout(int channel, void* msg, int timeout);
+
+/*
+ * Similar to ch_send except this one does not block. If the channel is
+ * full, it immediately returns 0 and the caller still owns msg. If the
+ * message was sent, returns 1. returns CH_CLOSED if the channel was
+ * closed and < 0 on other errors.
+ */
+int ch_trysend(int channel, void* msg);
+
+/*
+ * Sends a message with the given priority on a CH_MODE_PRIORITY channel,
+ * ahead of every pending message of a lower priority. Otherwise behaves
+ * like ch_send. priority 0 may be used on any channel.
+ * returns 0 on success, CH_CLOSED as for ch_send and CH_ERROR on other
+ * errors, e.g. if the priority is out of range.
+ */
+int ch_send_priority(int channel, void* msg, int priority);
+
+/*
+ * Most subscriptions a CH_MODE_BROADCAST channel can have at a time.
+ */
+#define CH_MAX_SUBSCRIBERS 64
+
+/*
+ * Publishes msg to every current subscription of a CH_MODE_BROADCAST
+ * channel. It is released right away if there are none. Otherwise
+ * behaves like ch_send, and ch_send and the other sends do the same on a
+ * broadcast channel.
+ * returns 0 on success and < 0 on error.
+ */
+int ch_publish(int channel, void* msg);
+
+/*
+ * Subscribes to a CH_MODE_BROADCAST channel. The subscription receives
+ * every message published from now on.
+ * returns the subscription number on success and < 0 on error.
+ */
+int ch_subscribe(int channel);
+
+/*
+ * Ends a subscription. Messages it has not yet received are released if
+ * no other subscription still needs them.
+ * returns 0 on success and < 0 on error.
+ *
+ * Preconditions: no-one is receiving on the subscription.
+ */
+int ch_unsubscribe(int channel, int sub);
+
+/*
+ * Receives the next message of a subscription.
+ * sub = the subscription number from ch_subscribe.
+ * dest = where to store the message. It stays valid until the next
+ * ch_recv_sub or ch_unsubscribe on the same subscription, and must not
+ * be changed or freed.
+ * timeout = how long to wait in milliseconds. 0 returns at once, < 0 waits
+ * for as long as it takes.
+ * returns 0 on success, CH_TIMEOUT if the timeout ran out first and
+ * CH_CLOSED once the channel is closed and the subscription has received
+ * every message published before. In both cases *dest is set to NULL.
+ *
+ * Preconditions: one thread at a time receives on a subscription.
+ */
+int ch_recv_sub(int channel, int sub, void** dest, int timeout);
+
+/*
+ * Sends n messages on a channel, in order, as if by n calls to ch_send but
+ * with one lock and wake-up round trip for as many of them as fit into the
+ * channel at once. Blocks until all n messages have been sent.
+ * msgs = array of n messages, none of which may be NULL.
+ * returns n on success and < 0 on error. If the channel is closed
+ * partway, returns how many were sent, or CH_CLOSED if none were.
+ */
+int ch_send_many(int channel, void** msgs, int n);
+
 /*
  * Receive a message on a channel. If no message is available,
  * this function blocks until one is received.
  * channel = the channel number.
  * dest = address of a pointer where the message should be stored.
- * This transfers ownership of the message to the receiver.
- * returns 0 on success and < 0 on error.
+ * This is the very pointer that was passed to ch_send, and receiving
+ * transfers ownership of the message to the receiver. No memory is
+ * allocated on either side of the hand-over.
+ * returns 0 on success, CH_CLOSED if the channel was closed and all its
+ * messages have been received, and CH_ERROR on other errors.
  * In case of an error, *dest is set to NULL.
  *
  */
 int ch_recv(int channel, void** dest);
 
+/*
+ * Like ch_recv, but gives up if no message arrived after timeout
+ * milliseconds, measured on CLOCK_MONOTONIC from the call. A timeout < 0
+ * waits for as long as it takes.
+ * returns 0 on success, CH_TIMEOUT if the time ran out, CH_CLOSED as for
+ * ch_recv and CH_ERROR on other errors. Unless it returns 0, *dest is set
+ * to NULL.
+ */
+int ch_recv_timeout(int channel, void** dest, int timeout);
+
+/*
+ * Receives up to max messages on a channel in one go. Blocks until at
+ * least one message is available, then takes as many pending messages as
+ * there are, up to max, without waiting for more.
+ * dest = array of at least max pointers where the messages are stored
+ * in the order they were sent.
+ * returns the number of messages received (>= 1), CH_CLOSED as for
+ * ch_recv or < 0 on other errors.
+ */
+int ch_recv_many(int channel, void** dest, int max);
+
 /*
  * Similar to ch_recv except this one does not block. If no message
  * is available on this channel, it immediately returns with value
  * 0 and *dest set to NULL. If a message was retrieved, returns 1
- * and *dest is set to the message.
+ * and *dest is set to the message. Returns CH_CLOSED as for ch_recv.
  */
 int ch_tryrecv(int channel, void** dest);
 
+/*
+ * Sends a value on a channel opened with a value_size. The value_size
+ * bytes at value are copied into the channel, so the caller keeps value
+ * and nothing is allocated. Otherwise behaves like ch_send.
+ * returns 0 on success and < 0 on error, e.g. on a channel of pointers.
+ */
+int ch_send_value(int channel, const void* value);
+
+/*
+ * Receives a value sent by ch_send_value, copying its value_size bytes
+ * to dest. Otherwise behaves like ch_recv.
+ * returns 0 on success and < 0 on error.
+ */
+int ch_recv_value(int channel, void* dest);
+
+/*
+ * Events for ch_select.
+ * CH_SELECT_RECV = the channel has a message pending.
+ * CH_SELECT_SEND = the channel has room for another message.
+ */
+enum ch_select_events {
+    CH_SELECT_RECV = 1,
+    CH_SELECT_SEND = 2
+};
+
+/*
+ * One entry of the array passed to ch_select.
+ * channel = the channel number.
+ * events = the CH_SELECT_* events to wait for, or'ed together.
+ * revents = set by ch_select to the events that are ready.
+ */
+typedef struct {
+    int channel;
+    int events;
+    int revents;
+} ch_selector;
+
+/*
+ * Waits until at least one of n channels is ready for the events asked
+ * for in sel, much like poll(). The calling thread sleeps until a channel
+ * changes state; it does not poll.
+ * timeout = how long to wait in milliseconds. 0 returns at once, < 0 waits
+ * for as long as it takes.
+ * returns the number of entries with revents set, 0 if the timeout ran out
+ * first, and < 0 on error.
+ *
+ * Readiness is a snapshot: when several threads use the same channel, a
+ * following ch_tryrecv may still find it empty. A closed channel is ready
+ * for both events, so that the following call returns CH_CLOSED.
+ */
+int ch_select(ch_selector* sel, int n, int timeout);
+
 /*
  * Check if there is currently a message pending in the channel.
  * channel = the channel number.
@@ -68,3 +453,115 @@ int ch_tryrecv(int channel, void** dest);
  * -1 in case of errors.
  */
 int ch_peek(int channel);
+
+/*
+ * Number of messages in the channel right now. Like ch_peek, only a
+ * snapshot while others send or receive on it. A rendezvous channel
+ * always has 0.
+ * returns the number on success and < 0 on error.
+ */
+int ch_depth(int channel);
+
+/*
+ * returns the capacity the channel was opened with, and < 0 on error.
+ */
+int ch_capacity(int channel);
+
+/*
+ * Returns a file descriptor, an eventfd, that is readable exactly while a
+ * receive on the channel would not block: while a message is pending or
+ * once the channel is closed. It can be added to an epoll or poll set,
+ * level- or edge-triggered, to receive with ch_tryrecv from an existing
+ * I/O loop. Do not read from or write to it; the channel keeps it in step
+ * with every send and receive. Every call returns the same descriptor,
+ * which ch_release closes.
+ * returns the descriptor on success and < 0 on error.
+ *
+ * Like ch_select, it only notices messages sent to a shared channel by the
+ * calling process.
+ */
+int ch_fd(int channel);
+
+/*
+ * A message handler.
+ * channel = the channel the message came from.
+ * msg = the message, which the handler now owns. On a channel of values it
+ * points to a copy that is only valid until the handler returns. NULL once
+ * the channel has been closed and drained; the handler is removed before
+ * this last call, so it may release the channel.
+ * ctx = the ctx given to ch_on_message.
+ */
+typedef void (*ch_handler)(int channel, void* msg, void* ctx);
+
+/*
+ * Has the executor receive every message sent on a channel and pass it
+ * to fn, instead of a thread blocking in ch_recv.
+ * fn = the handler, or NULL to remove the channel's handler.
+ * returns 0 on success and < 0 on error.
+ *
+ * A channel is handed to an executor thread only when a send or close
+ * changes its state, and to one thread at a time, so its messages reach
+ * the handler in order. A channel that has nothing to receive costs no
+ * thread and no wake-ups. Messages sent to a shared channel by another
+ * process are only noticed with the next local send or close.
+ * Preconditions: no-one else receives from the channel.
+ */
+int ch_on_message(int channel, ch_handler fn, void* ctx);
+
+/*
+ * Starts the executor, a pool of threads that run the message handlers.
+ * Handlers registered before it starts run as soon as it does.
+ * threads = how many threads to start, or 0 for one per CPU.
+ * returns 0 on success and < 0 on error.
+ */
+int ch_executor_start(int threads);
+
+/*
+ * Stops the executor once its threads have returned from the handlers
+ * they are running. Handlers stay registered and messages stay queued
+ * until it is started again.
+ * returns 0 on success and < 0 on error.
+ */
+int ch_executor_stop();
+
+/*
+ * Number of buckets of the wait histograms in ch_metrics.
+ */
+#define CH_STATS_BUCKETS 32
+
+/*
+ * Statistics of a channel since it was opened, filled in by ch_stats.
+ * sent, received = messages sent and received.
+ * depth = messages in the channel right now.
+ * high_water = the most messages the channel has held after a send, as
+ * far as its senders could tell: an SPSC sender goes by what it last saw
+ * of the receiver, which may overstate the depth, and MPMC senders only
+ * look every 64 messages.
+ * send_waits, recv_waits = how often senders found the channel full and
+ * receivers found it empty, by how long they had to wait: bucket i counts
+ * waits of 2^i to 2^(i+1) - 1 nanoseconds, the last bucket longer ones.
+ * send_wait_ns, recv_wait_ns = total time senders and receivers waited.
+ *
+ * The counters are updated without locks, so a snapshot taken while the
+ * channel is in use may be off by the messages in flight.
+ */
+typedef struct {
+    unsigned long sent;
+    unsigned long received;
+    int depth;
+    int high_water;
+    unsigned int send_waits[CH_STATS_BUCKETS];
+    unsigned int recv_waits[CH_STATS_BUCKETS];
+    unsigned long send_wait_ns;
+    unsigned long recv_wait_ns;
+} ch_metrics;
+
+/*
+ * Takes a snapshot of a channel's statistics. Keeping them costs a few
+ * relaxed atomic updates per send and receive, and clock readings only
+ * when a thread has to wait; building the library with -DCH_NO_STATS
+ * leaves them out altogether.
+ * returns 0 on success and < 0 on error, e.g. if statistics were left
+ * out.
+ */
+int ch_stats(int channel, ch_metrics* out);
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include "channels.h"
+
+/*
+ * Contention benchmark: an equal number of sender and receiver threads
+ * hammer one channel, first in CH_MODE_LOCKED and then in CH_MODE_MPMC.
+ *
+ * use: ./contention [messages per sender]
+ */
+
+#define CHANNEL 1
+#define CAPACITY 64
+
+const int THREADS[] = {1, 2, 4, 8, 16};
+const int N_THREADS = sizeof(THREADS) / sizeof(THREADS[0]);
+
+long n_messages = 200000;
+
+void* sender(void* param) {
+    for (long i = 1; i <= n_messages; i++) {
+        /* the channel only looks at the pointer, so any non-NULL value will do */
+        int err = ch_send(CHANNEL, (void*) i);
+        if (err) { puts("Send error."); abort(); }
+    }
+    return NULL;
+}
+
+void* receiver(void* param) {
+    void *m;
+    for (long i = 1; i <= n_messages; i++) {
+        int err = ch_recv(CHANNEL, &m);
+        if (err) { puts("Recv error."); abort(); }
+    }
+    return NULL;
+}
+
+double run(int mode, int threads) {
+    pthread_t senders[16];
+    pthread_t receivers[16];
+    struct timespec start, end;
+    ch_attr attr;
+    int err;
+
+    ch_attr_init(&attr);
+    attr.capacity = CAPACITY;
+    attr.mode = mode;
+    if (ch_open(CHANNEL, &attr) < 0) { puts("Open error."); abort(); }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        err = pthread_create(receivers + i, NULL, receiver, NULL);
+        if (err) { puts("Failed to create receiver."); abort(); }
+        err = pthread_create(senders + i, NULL, sender, NULL);
+        if (err) { puts("Failed to create sender."); abort(); }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(senders[i], NULL);
+        pthread_join(receivers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1.0e9;
+    return threads * n_messages / seconds;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        n_messages = atol(argv[1]);
+        if (n_messages <= 0) { puts("use: ./contention [messages per sender]"); return 1; }
+    }
+    int e = ch_setup(); if (e < 0) { puts("setup failed"); return 1; }
+
+    printf("%8s %16s %16s\n", "threads", "locked msg/s", "mpmc msg/s");
+    for (int i = 0; i < N_THREADS; i++) {
+        double locked = run(CH_MODE_LOCKED, THREADS[i]);
+        double mpmc = run(CH_MODE_MPMC, THREADS[i]);
+        printf("%8i %16.0f %16.0f\n", THREADS[i], locked, mpmc);
+    }
+
+    ch_destroy();
+    return 0;
+}
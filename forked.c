@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include "channels.h"
+
+/*
+ * Cross-process demo: the program forks, and the parent sends numbered
+ * messages to the child over a CH_MODE_SHARED channel. The child checks
+ * that they arrive in order and intact, and once both have released the
+ * channel the parent checks that its shared memory object is gone. See
+ * make shm.
+ *
+ * use: ./forked [messages]
+ */
+
+#define CAPACITY 16
+#define TIMEOUT 5000
+
+struct message {
+    long seq;
+    char text[48];
+};
+
+long n_messages = 1000;
+char name[64];
+
+int open_shared() {
+    ch_attr attr;
+    ch_attr_init(&attr);
+    attr.mode = CH_MODE_SHARED;
+    attr.capacity = CAPACITY;
+    attr.msg_size = sizeof(struct message);
+    attr.name = name;
+    return ch_open(CH_NEW, &attr);
+}
+
+/* the child: receives until the parent closes the channel */
+int receive() {
+    struct message* m;
+    long received = 0;
+    char text[48];
+    int err;
+
+    if (ch_setup() < 0) { puts("setup failed"); return 1; }
+    int channel = open_shared();
+    if (channel < 0) { puts("Open error."); return 1; }
+
+    while ((err = ch_recv_timeout(channel, (void**) &m, TIMEOUT)) == 0) {
+        snprintf(text, sizeof(text), "message #%li", received + 1);
+        if (m->seq != received + 1 || strcmp(m->text, text) != 0) {
+            printf("Child %i: got message %li (%s), expected %li.\n",
+                getpid(), m->seq, m->text, received + 1);
+            return 1;
+        }
+        received++;
+        ch_msg_free(m);
+    }
+    if (err != CH_CLOSED) { printf("Recv error %i.\n", err); return 1; }
+    printf("Child %i has received %li messages in order.\n", getpid(), received);
+
+    if (ch_release(channel) < 0) { puts("Release error."); return 1; }
+    ch_destroy();
+    return received == n_messages ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    char path[80];
+    int status;
+    pid_t child;
+
+    if (argc > 1) {
+        n_messages = atol(argv[1]);
+        if (n_messages <= 0) { puts("use: ./forked [messages]"); return 1; }
+    }
+    snprintf(name, sizeof(name), "/ch-forked-%i", getpid());
+
+    fflush(stdout);
+    child = fork();
+    if (child < 0) { perror("fork"); return 1; }
+    if (child == 0) {
+        exit(receive());
+    }
+
+    if (ch_setup() < 0) { puts("setup failed"); return 1; }
+    int channel = open_shared();
+    if (channel < 0) { puts("Open error."); return 1; }
+
+    for (long i = 1; i <= n_messages; i++) {
+        struct message* m = ch_msg_alloc(channel);
+        if (m == NULL) { puts("Alloc error."); return 1; }
+        m->seq = i;
+        snprintf(m->text, sizeof(m->text), "message #%li", i);
+        int err = ch_send_timeout(channel, m, TIMEOUT);
+        if (err) { printf("Send error %i.\n", err); return 1; }
+    }
+    printf("Parent %i has sent %li messages.\n", getpid(), n_messages);
+    if (ch_close(channel) < 0) { puts("Close error."); return 1; }
+
+    if (waitpid(child, &status, 0) < 0) { perror("waitpid"); return 1; }
+    if (ch_release(channel) < 0) { puts("Release error."); return 1; }
+    ch_destroy();
+
+    /* the last process to release the channel removes it */
+    snprintf(path, sizeof(path), "/dev/shm%s", name);
+    if (access(path, F_OK) == 0) {
+        printf("%s is still there.\n", path);
+        shm_unlink(name);
+        return 1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        puts("The child failed.");
+        return 1;
+    }
+    printf("%s has been removed.\n", path);
+    return 0;
+}
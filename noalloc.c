@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "channels.h"
+
+/*
+ * Regression test for the allocation-free message path. Linked with
+ * -Wl,--wrap for the allocator's entry points, so that every allocation
+ * the channels make is counted; after a warm-up round, sending and
+ * receiving on a channel of each mode, with pointers, values and pooled
+ * messages, must not allocate at all. See make tsan.
+ *
+ * use: ./noalloc
+ */
+
+#define CAPACITY 16
+#define ROUNDS 1000
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+int __real_posix_memalign(void** p, size_t align, size_t size);
+
+long allocations;
+
+void* __wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+    allocations++;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* p, size_t size) {
+    allocations++;
+    return __real_realloc(p, size);
+}
+
+int __wrap_posix_memalign(void** p, size_t align, size_t size) {
+    allocations++;
+    return __real_posix_memalign(p, align, size);
+}
+
+enum { TYPE_POINTER, TYPE_VALUE, TYPE_POOL };
+
+const char* MODES[] = {"locked", "spsc", "mpmc"};
+const char* TYPES[] = {"pointer", "value", "pool"};
+
+long values[CAPACITY];
+
+void* message(int channel, int type, int i) {
+    long* m = &values[i];
+    if (type == TYPE_POOL && (m = ch_msg_alloc(channel)) == NULL) {
+        puts("Alloc error.");
+        exit(1);
+    }
+    *m = i;
+    return m;
+}
+
+/* fills the channel and drains it again, one message at a time and then
+   in one batch */
+void round_trip(int channel, int type) {
+    void* msgs[CAPACITY];
+    long value;
+    int err, got;
+
+    for (int i = 0; i < CAPACITY; i++) {
+        value = i;
+        if (type == TYPE_VALUE) {
+            err = ch_send_value(channel, &value);
+        } else if (i % 2) {
+            err = ch_send(channel, message(channel, type, i));
+        } else {
+            err = ch_trysend(channel, message(channel, type, i)) - 1;
+        }
+        if (err) { puts("Send error."); exit(1); }
+    }
+    for (int i = 0; i < CAPACITY; i++) {
+        if (type == TYPE_VALUE) {
+            err = ch_recv_value(channel, &value);
+        } else {
+            err = i % 2 ? ch_recv(channel, msgs) : ch_tryrecv(channel, msgs) - 1;
+        }
+        if (err) { puts("Recv error."); exit(1); }
+        if (type == TYPE_POOL) {
+            ch_msg_free(msgs[0]);
+        }
+    }
+    if (type == TYPE_VALUE) {
+        return;
+    }
+
+    for (int i = 0; i < CAPACITY; i++) {
+        msgs[i] = message(channel, type, i);
+    }
+    if (ch_send_many(channel, msgs, CAPACITY) != CAPACITY) { puts("Send error."); exit(1); }
+    for (got = 0; got < CAPACITY; got += err) {
+        err = ch_recv_many(channel, msgs + got, CAPACITY - got);
+        if (err < 1) { puts("Recv error."); exit(1); }
+    }
+    for (int i = 0; i < CAPACITY && type == TYPE_POOL; i++) {
+        ch_msg_free(msgs[i]);
+    }
+}
+
+int run(int mode, int type) {
+    ch_attr attr;
+    long before;
+    int channel;
+
+    ch_attr_init(&attr);
+    attr.mode = mode;
+    attr.capacity = CAPACITY;
+    attr.value_size = type == TYPE_VALUE ? sizeof(long) : 0;
+    attr.msg_size = type == TYPE_POOL ? sizeof(long) : 0;
+    channel = ch_open(CH_NEW, &attr);
+    if (channel < 0) { puts("Open error."); exit(1); }
+
+    round_trip(channel, type);
+    before = allocations;
+    for (int i = 0; i < ROUNDS; i++) {
+        round_trip(channel, type);
+    }
+    long made = allocations - before;
+
+    if (ch_release(channel) < 0) { puts("Release error."); exit(1); }
+    printf("%-7s %-8s %li allocations: %s\n", MODES[mode], TYPES[type], made,
+        made ? "FAILED" : "ok");
+    return made != 0;
+}
+
+int main(int argc, char** argv) {
+    int failed = 0;
+    if (ch_setup() < 0) { puts("setup failed"); return 1; }
+
+    for (int mode = CH_MODE_LOCKED; mode <= CH_MODE_MPMC; mode++) {
+        for (int type = TYPE_POINTER; type <= TYPE_POOL; type++) {
+            failed |= run(mode, type);
+        }
+    }
+
+    ch_destroy();
+    return failed;
+}
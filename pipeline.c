@@ -7,31 +7,33 @@
 #include <time.h>
 
 #include "channels.h"
+#include "workers.h"
 
 /*
- * The 5-stage pipeline demo.
+ * The 5-stage pipeline demo. The stages are declared with
+ * ch_pipeline_add and run on a pool of workers, which move to whichever
+ * stage has work; the upgrading stages get as many workers as their
+ * input queues call for.
+ *
+ * use: ./pipeline [workers, default one per CPU]
  */
 
+const int N_ITEMS = 15;
+const int N_STAGES = 5;
+const int CAPACITY = 4;
+
 struct item {
     int id;
     int stage;
 };
 
-enum messages {
-    MSG_ITEM,
-    MSG_DONE
-};
-
 typedef struct {
-    enum messages type;
     struct item item;
 } message;
 
 typedef struct {
-    int n_items;
-    int stage;
-    int id;
-} thread_info;
+    int items;
+} stage_info;
 
 struct timespec spec;
 double offset() {
@@ -41,97 +43,56 @@ double offset() {
     return o;
 }
 
-void* worker(void* param) {
-    thread_info *info = (thread_info*) param;
-    int err;
-    int done = 0;
-    int items = 1;
-    
-    printf("[%0.6f] This is thread %i (stage %i).\n", offset(), info->id, info->stage);
-    if (info->stage == 1) {
-        printf("[%0.6f] I am going to produce %i items.\n", offset(), info->n_items);
-    } else if (info->stage == 5) {
-        printf("[%0.6f] I am going to consume %i items.\n", offset(), info->n_items);
+/* stage 1: produce items, one run at a time */
+void* produce(void* msg, void* ctx) {
+    stage_info *info = ctx;
+    if (info->items == N_ITEMS) {
+        printf("[%0.6f] Worker %i is done producing items.\n", offset(), ch_worker_id());
+        return NULL;
+    }
+    usleep((1 + random() % 5) * 100 * 1000);
+    message *m = malloc(sizeof(message));
+    if (m == NULL) {
+        puts("Out of memory!");
+        abort();
     }
+    m->item.id = ++info->items;
+    m->item.stage = 1;
+    printf("[%0.6f] Worker %i has produced item #%i.\n", offset(), ch_worker_id(), m->item.id);
+    return m;
+}
 
-    while (!done) {
-        if (info->stage == 1) {
-            /* produce items */
-            usleep((1 + random() % 5) * 100 * 1000);
-            message *m = malloc(sizeof(message));
-            if (m == NULL) {
-                puts("Out of memory!");
-                abort();
-            }
-            m->type = MSG_ITEM;
-            m->item.id = items;
-            m->item.stage = 1;
-            printf("[%0.6f] Thread %i has produced item #%i.\n", offset(), info->id, items);
-            items++;
-            err = ch_send(2, m);
-            if (err) {
-                puts("Send error.");
-                abort();
-            }
-            if (items > info->n_items) {
-                printf("[%0.6f] Thread %i is done producing items.\n", offset(), info->id);
-                done = 1;
-            }
-        } else {
-            /* since we're not the producer, fetch items. */
-            message *m;
-            printf("[%0.6f] Thread %i waiting to receive.\n", offset(), info->id);
-            err = ch_recv(info->stage, (void**) &m);
-            if (err) {
-                puts("Recv error.");
-                abort();
-            }
-            if (m->type == MSG_DONE) {
-                printf("[%0.6f] Thread %i got done message.\n", offset(), info->id);
-                done = 1;
-                free(m);
-            } else if (m->type == MSG_ITEM) {
-                if (info->stage == 5) {
-                    /* consume item */
-                    printf("[%0.6f] Thread %i is consuming item %i (stage %i).\n",
-                        offset(), info->id, m->item.id, m->item.stage);
-                        usleep(200 * 1000);
-                    free(m);
-                    items++;
-                    if (items > info->n_items) {
-                        printf("[%0.6f] Thread %i has consumed all items.\n",
-                            offset(), info->id);
-                        message *m = malloc(sizeof(message));
-                        if (m == NULL) {
-                            puts("Out of memory.");
-                            abort();
-                        }
-                        m->type = MSG_DONE;
-                        err = ch_send(0, m);
-                        if (err) {
-                            puts("Send error.");
-                            abort();
-                        }
-                    }
-                } else {
-                    /* upgrade item and pass it on. */
-                    printf("[%0.6f] Thread %i is upgrading item %i (stage %i).\n",
-                        offset(), info->id, m->item.id, m->item.stage);
-                    usleep((2 + random() % 3) * 100 * 1000);
-                    m->item.stage++;
-                    err = ch_send(info->stage + 1, m);
-                    if (err) {
-                        puts("Send error.");
-                        abort();
-                    }
-                }
-            } else {
-                printf("Unexpected message: %i\n", m->type);
-                abort();
-            }
-        }
+/* stages 2 to 4: upgrade items and pass them on */
+void* upgrade(void* msg, void* ctx) {
+    message *m = msg;
+    printf("[%0.6f] Worker %i is upgrading item %i (stage %i).\n",
+        offset(), ch_worker_id(), m->item.id, m->item.stage);
+    usleep((2 + random() % 3) * 100 * 1000);
+    m->item.stage++;
+    return m;
+}
+
+void report() {
+    ch_stage_metrics m;
+    for (int i = 0; i < N_STAGES; i++) {
+        if (ch_stage_stats(i, &m) < 0) { puts("Stats error."); return; }
+        printf("  stage %i: %lu calls, %i worker(s), %3.0f%% busy, queue %i/%i\n",
+            i + 1, m.calls, m.parallel, 100 * m.utilization, m.depth, m.capacity);
+    }
+}
+
+/* stage 5: consume items, one run at a time */
+void* consume(void* msg, void* ctx) {
+    stage_info *info = ctx;
+    message *m = msg;
+    printf("[%0.6f] Worker %i is consuming item %i (stage %i).\n",
+        offset(), ch_worker_id(), m->item.id, m->item.stage);
+    usleep(200 * 1000);
+    free(m);
+    if (++info->items == N_ITEMS) {
+        printf("[%0.6f] Worker %i has consumed all items.\n", offset(), ch_worker_id());
+        report();
     }
-    printf("[%0.6f] Thread %i is done.\n", offset(), info->id);
     return NULL;
 }
 
@@ -139,67 +100,29 @@ int main(int argc, char** argv) {
     time_t start_time; time(&start_time);
     srand((unsigned) start_time);
     int e = ch_setup(); if (e < 0) { puts("setup failed"); return 1; }
+    int workers = argc > 1 ? atoi(argv[1]) : 0;
 
-    pthread_t threads[7];
-    thread_info info[7] = {
-    /*    n_items  stage  id */
-        {      15,     1,  1 },
-        {       0,     2,  2 },
-        {       0,     3,  3 },
-        {       0,     3,  4 },
-        {       0,     4,  5 },
-        {       0,     4,  6 },
-        {      15,     5,  7 }
-    };
+    stage_info first = {0};
+    stage_info last = {0};
+    /* the producer and the consumer keep count, so only one worker may
+       run them at a time; the others grow to what their queues need */
+    if (ch_pipeline_add(produce, &first, 1, 0) < 0) { puts("Failed to add stage."); return 1; }
+    for (int i = 2; i < N_STAGES; i++) {
+        if (ch_pipeline_add(upgrade, NULL, CH_STAGE_AUTO, CAPACITY) < 0) {
+            puts("Failed to add stage.");
+            return 1;
+        }
+    }
+    if (ch_pipeline_add(consume, &last, 1, CAPACITY) < 0) { puts("Failed to add stage."); return 1; }
 
     puts("Running ...");
     clock_gettime(CLOCK_REALTIME, &spec);
-    int err;
-    for (int i = 0; i < 7; i++) {
-        err = pthread_create(threads + i, NULL, worker, info + i);
-        if (err) { puts("Failed to create thread."); return 1; }
-    }
+    if (ch_workers_start(workers) < 0) { puts("Failed to start workers."); return 1; }
 
-    message *done_message;
-    err = ch_recv(0, (void**) &done_message);
-    if (err) { puts("Failed to listen on DONE channel."); return 1; }
-    if (done_message->type != MSG_DONE) {
-        printf("Expected 'done', got %i\n", done_message->type);
-        return 7;
-    }
-    free(done_message);    
-
-    /* tell everyone in the later stages to finish */
-    printf("[%0.6f] main thread: cleanup time.\n", offset());
-    for (int i = 0; i < 7; i++) {
-        if (info[i].stage > 1) {
-            done_message = malloc(sizeof(message));
-            if (done_message == NULL) {
-                puts("Out of memory while cleaning up.");
-                return 1;
-            }
-            done_message->type = MSG_DONE;
-            /* There is no guarantee that the message will go to the 'intended'
-               thread. What we do know is that each stage will get the correct
-               number of messages so everyone ends up terminating.
-            */
-            printf("[%0.6f] main thread sending 'done' on channel %i.\n", offset(), info[i].stage);
-            err = ch_send(info[i].stage, done_message);
-            if (err) {
-                puts("Error sending done message.");
-                return 1;
-            }
-        }
-    }
+    /* once the producer is done, every stage closes the channel after it
+       as soon as it has drained its own, which shuts the pipeline down */
+    if (ch_workers_wait() < 0) { puts("Wait error."); return 1; }
 
-    for (int i = 0; i < 7; i++) {
-        err = pthread_join(threads[i], NULL);
-        if (err) {
-            puts("Join error.");
-            return 1;
-        }
-    }
-    
     printf("[%0.6f] Done.\n", offset());
     return 0;
 }
@@ -13,16 +13,10 @@
 
 enum channel_names {
     ITEM_CHANNEL=1,
-    DONE_CHANNEL=0
-};
-
-enum messages {
-    MSG_ITEM,
-    MSG_DONE
+    DONE_CHANNEL=2
 };
 
 typedef struct {
-    enum messages type;
     int item_number;
 } message;
 
@@ -42,7 +36,6 @@ void* producer(void* param) {
         }
         message *message = malloc(sizeof(message));
         if (message == NULL) { puts("Out of memory"); abort(); }
-        message->type = MSG_ITEM;
         message->item_number = i + 1;
         printf("Item %i from producer is finished.\n", i+1);
 
@@ -51,82 +44,55 @@ void* producer(void* param) {
         if (err) { puts("Failed to add item"); abort(); }
     }
 
-    /* Tell the main thread that we are done. */
-    message *message = malloc(sizeof(message));
-    if (message == NULL) { puts("Out of memory"); abort(); }
-    message->type = MSG_DONE;
-    err = ch_send(DONE_CHANNEL, message);
+    /* Tell the consumer that there is nothing more to come. */
+    err = ch_close(ITEM_CHANNEL);
     if (err) {
-        puts("Failed to send shut down message.");
+        puts("Failed to close the item channel.");
         abort();
     }
-    
+
     printf("Producer done.\n");
     return NULL;
 }
 
-void* consumer(void* param) {
-    message *message;
-    puts("Consumer is ready.");
-
-    for (;;) {
-        int err = ch_peek(ITEM_CHANNEL);
-        if (err < 0) {
-            puts("Peek error.");
-            abort();
-        } else if (err == 0) {
-            printf("Consumer: looks like we have to wait.\n");
-        } else {
-            printf("Consumer: looks like we have a message.\n");
-        }
-        
-        err = ch_recv(ITEM_CHANNEL, (void**) &message);
-        if (err < 0) { puts("Error receiving message."); abort(); }
-        
-        
-        if (message->type == MSG_ITEM) {
-            printf("Consumer is consuming item %i from producer.\n", message->item_number);
-            usleep(300*1000);
-            free(message);
-        } else if (message->type == MSG_DONE) {
-            printf("Consumer: all items consumed.\n");
-            free(message);
-            return NULL;
-        }
+void consume(int channel, void* msg, void* ctx) {
+    message *message = msg;
+    if (message == NULL) {
+        printf("Consumer: all items consumed.\n");
+        /* wake up main, which waits on the done channel */
+        if (ch_close(DONE_CHANNEL)) { puts("Failed to close the done channel."); abort(); }
+        return;
     }
+
+    printf("Consumer is consuming item %i from producer.\n", message->item_number);
+    usleep(300*1000);
+    free(message);
 }
 
 int main(int argc, char** argv) {
-    //printf("Hello.\n");
+    void *nothing;
     int e = ch_setup(); if (e < 0) { puts("setup failed"); return 1; }
-    
-    //
-    //printf("I got here.\n");
-    //
-    
+
     pthread_t producer_thread;
-    pthread_t consumer_thread;
+
+    /* the consumer is a handler run by the executor, not a thread of its own */
+    int err = ch_on_message(ITEM_CHANNEL, consume, NULL);
+    if (err) { puts("Failed to register the consumer."); return 1; }
+    puts("Consumer is ready.");
 
     puts("Running ...");
-    int err = pthread_create(&producer_thread, NULL, producer, NULL);
+    err = ch_executor_start(1);
+    if (err) { puts("Failed to start the executor."); return 1; }
+    err = pthread_create(&producer_thread, NULL, producer, NULL);
     if (err) { puts("Failed to create producer."); return 1; }
-    err = pthread_create(&consumer_thread, NULL, consumer, NULL);
-    if (err) { puts("Failed to create consumer."); return 1; }
 
-    message *done_message;
-    err = ch_recv(DONE_CHANNEL, (void**) &done_message);
-    if (err) { puts("Failed to listen on DONE channel."); return 1; }
-    
     err = pthread_join(producer_thread, NULL);
     if (err) { return 1; }
-    
-    /* the message belongs to us, so we can send it on */
-    err = ch_send(ITEM_CHANNEL, done_message);
-    if (err) { return 1; }
-    
-    err = pthread_join(consumer_thread, NULL);
-    if (err) { return 1; }
-    
+
+    err = ch_recv(DONE_CHANNEL, &nothing);
+    if (err != CH_CLOSED) { puts("Error waiting for the consumer."); return 1; }
+
+    ch_executor_stop();
     puts("Done.");
     return 0;
 }
@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+
+#include "channels.h"
+
+/*
+ * Stress test of the channels' synchronization. Senders and receivers
+ * hammer a few channels at a time with a mix of blocking, non-blocking,
+ * timed and batch calls until the senders are done and the channels are
+ * closed, once for each kind of channel and for both backends. Every
+ * message must arrive exactly once, and each receiver must see the
+ * messages of a sender in the order they were sent. The messages of each
+ * kind are split evenly between its senders. Meant to be run under
+ * ThreadSanitizer, see make tsan.
+ *
+ * use: ./stress [messages per kind]
+ */
+
+#define CHANNELS 4
+#define THREADS 4
+#define BATCH 8
+
+struct kind {
+    const char* name;
+    int backend;
+    int mode;
+    int capacity;
+    int threads;
+    int batch;
+    long messages;
+};
+
+/* the senders on the big socket channel write batches that overflow the
+   connection's buffers while the receivers still drain it, and each send
+   a fixed number of messages, enough for two of them */
+const struct kind KINDS[] = {
+    {"locked", CH_BACKEND_MEMORY, CH_MODE_LOCKED, 16, THREADS, BATCH, 0},
+    {"locked", CH_BACKEND_MEMORY, CH_MODE_LOCKED, 1, THREADS, BATCH, 0},
+    {"spsc", CH_BACKEND_MEMORY, CH_MODE_SPSC, 16, 1, BATCH, 0},
+    {"mpmc", CH_BACKEND_MEMORY, CH_MODE_MPMC, 16, THREADS, BATCH, 0},
+    {"rendezvous", CH_BACKEND_MEMORY, CH_MODE_LOCKED, 0, THREADS, BATCH, 0},
+    {"socket", CH_BACKEND_SOCKET, CH_MODE_LOCKED, 16, THREADS, BATCH, 0},
+    {"socket", CH_BACKEND_SOCKET, CH_MODE_LOCKED, 1 << 20, 2, 1 << 19, 1 << 20},
+};
+const int N_KINDS = sizeof(KINDS) / sizeof(KINDS[0]);
+
+long n_messages = 1000000;
+
+struct worker {
+    pthread_t thread;
+    int channel;
+    int id;
+    int threads;
+    int batch;
+    long messages;
+    long received;
+    unsigned long sum;
+    long last[THREADS];
+    int failed;
+};
+
+/* messages are the number of their sender, from 1, and their sequence
+   number, from 1, so none is NULL */
+static void* message(int sender, long seq) {
+    return (void*) (((unsigned long) (sender + 1) << 32) | seq);
+}
+
+void* sender(void* param) {
+    struct worker* w = param;
+    void** batch = malloc(w->batch * sizeof(void*));
+    long seq = 1;
+    int err;
+
+    if (batch == NULL) { puts("Out of memory!"); abort(); }
+    while (seq <= w->messages) {
+        switch (seq % 4) {
+        case 0:
+            err = ch_send(w->channel, message(w->id, seq));
+            break;
+        case 1:
+            while ((err = ch_trysend(w->channel, message(w->id, seq))) == 0) {
+                sched_yield();
+            }
+            err = err == 1 ? 0 : err;
+            break;
+        case 2:
+            while ((err = ch_send_timeout(w->channel, message(w->id, seq), 1)) == CH_TIMEOUT) {
+            }
+            break;
+        default: {
+            int n = 0;
+            while (n < w->batch && seq + n <= w->messages) {
+                batch[n] = message(w->id, seq + n);
+                n++;
+            }
+            err = ch_send_many(w->channel, batch, n);
+            if (err == n) {
+                seq += n - 1;
+                err = 0;
+            }
+            break;
+        }
+        }
+        if (err) { printf("Send error %i on channel %i.\n", err, w->channel); abort(); }
+        seq++;
+    }
+    free(batch);
+    return NULL;
+}
+
+static void take(struct worker* w, void* m) {
+    unsigned long v = (unsigned long) m;
+    int from = (v >> 32) - 1;
+    long seq = v & 0xffffffffUL;
+    if (from < 0 || from >= w->threads || seq <= w->last[from]) {
+        printf("Channel %i: message %i/%li after %li.\n", w->channel, from, seq,
+            from < 0 || from >= w->threads ? 0 : w->last[from]);
+        w->failed = 1;
+        return;
+    }
+    w->last[from] = seq;
+    w->received++;
+    w->sum += v;
+}
+
+void* receiver(void* param) {
+    struct worker* w = param;
+    void* batch[2 * BATCH];
+    void* m;
+    int err;
+
+    for (long i = 0;; i++) {
+        switch (i % 4) {
+        case 0:
+            err = ch_recv(w->channel, &m);
+            if (err == 0) { take(w, m); }
+            break;
+        case 1:
+            err = ch_tryrecv(w->channel, &m);
+            if (err == 1) { take(w, m); }
+            err = err == 1 ? 0 : err;
+            break;
+        case 2:
+            err = ch_recv_timeout(w->channel, &m, 1);
+            if (err == 0) { take(w, m); }
+            err = err == CH_TIMEOUT ? 0 : err;
+            break;
+        default:
+            err = ch_recv_many(w->channel, batch, 2 * BATCH);
+            for (int j = 0; j < err; j++) {
+                take(w, batch[j]);
+            }
+            err = err > 0 ? 0 : err;
+            break;
+        }
+        if (err == CH_CLOSED) {
+            return NULL;
+        }
+        if (err) { printf("Recv error %i on channel %i.\n", err, w->channel); abort(); }
+    }
+}
+
+int run(const struct kind* k) {
+    struct worker senders[CHANNELS][THREADS];
+    struct worker receivers[CHANNELS][THREADS];
+    long senders_per_kind = CHANNELS * k->threads;
+    long messages = k->messages ? k->messages :
+        (n_messages + senders_per_kind - 1) / senders_per_kind;
+    ch_attr attr;
+    int failed = 0;
+
+    memset(senders, 0, sizeof(senders));
+    memset(receivers, 0, sizeof(receivers));
+    ch_attr_init(&attr);
+    attr.mode = k->mode;
+    attr.capacity = k->capacity;
+    for (int c = 0; c < CHANNELS; c++) {
+        int channel = ch_open(CH_NEW, &attr);
+        if (channel < 0) { puts("Open error."); abort(); }
+        for (int t = 0; t < k->threads; t++) {
+            senders[c][t] = (struct worker) {
+                .channel = channel, .id = t, .threads = k->threads, .batch = k->batch,
+                .messages = messages
+            };
+            receivers[c][t] = senders[c][t];
+            if (pthread_create(&receivers[c][t].thread, NULL, receiver, &receivers[c][t]) ||
+                pthread_create(&senders[c][t].thread, NULL, sender, &senders[c][t])) {
+                puts("Failed to create thread.");
+                abort();
+            }
+        }
+    }
+
+    for (int c = 0; c < CHANNELS; c++) {
+        long received = 0;
+        unsigned long sum = 0, expected = 0;
+        for (int t = 0; t < k->threads; t++) {
+            pthread_join(senders[c][t].thread, NULL);
+        }
+        if (ch_close(senders[c][0].channel) < 0) { puts("Close error."); abort(); }
+        for (int t = 0; t < k->threads; t++) {
+            pthread_join(receivers[c][t].thread, NULL);
+            received += receivers[c][t].received;
+            sum += receivers[c][t].sum;
+            failed |= receivers[c][t].failed;
+            for (long i = 1; i <= messages; i++) {
+                expected += (unsigned long) message(t, i);
+            }
+        }
+        if (received != k->threads * messages || sum != expected) {
+            printf("Channel %i: %li of %li messages arrived, checksum %s.\n",
+                senders[c][0].channel, received, k->threads * messages,
+                sum == expected ? "ok" : "wrong");
+            failed = 1;
+        }
+        if (ch_release(senders[c][0].channel) < 0) { puts("Release error."); abort(); }
+    }
+
+    printf("%-10s capacity %7i, %i x %i threads: %s\n", k->name, k->capacity,
+        CHANNELS, 2 * k->threads, failed ? "FAILED" : "ok");
+    return failed;
+}
+
+int main(int argc, char** argv) {
+    int failed = 0;
+    if (argc > 1) {
+        n_messages = atol(argv[1]);
+        if (n_messages <= 0) { puts("use: ./stress [messages per kind]"); return 1; }
+    }
+
+    for (int i = 0; i < N_KINDS; i++) {
+        if (ch_setup_backend(KINDS[i].backend) < 0) { puts("setup failed"); return 1; }
+        failed |= run(&KINDS[i]);
+        ch_destroy();
+    }
+    return failed;
+}
@@ -0,0 +1,726 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "channels.h"
+#include "workers.h"
+
+// how many messages a stage handles before it lets other stages in
+#define STAGE_BATCH 16
+// how often, and how many times in a row, the input of a CH_STAGE_AUTO
+// stage has to be found full or empty before its limit changes
+#define SCALE_INTERVAL_NS 10000000L
+#define SCALE_STREAK 3
+
+/*
+ * Stages. tasks counts the runs of a stage that are queued or going on
+ * and never exceeds parallel. A result that does not fit into the output
+ * channel any more is kept in held, which has room for one per run, and
+ * sent before the stage takes any more input. lock guards held, n_held,
+ * running and done; n_held and drained are also read without it, to
+ * decide whether the stage is worth running.
+ *
+ * parallel only changes for a CH_STAGE_AUTO stage, between 1 and
+ * max_parallel, when scale finds its input full or empty often enough in
+ * a row. The worker that moves checked on samples the input, so the
+ * streaks are only touched by one worker at a time. calls and busy_ns
+ * feed ch_stage_stats. own_in is set for the channels ch_pipeline_add
+ * opened, which are released with the stages.
+ */
+struct stage {
+    int in;
+    int out;
+    int parallel;
+    int max_parallel;
+    int auto_scale;
+    int own_in;
+    ch_stage_fn fn;
+    void* ctx;
+    struct stage* next;
+    int tasks;
+    int drained;
+    pthread_mutex_t lock;
+    int running;
+    int done;
+    int n_held;
+    void** held;
+    long checked;
+    int full_streak;
+    int idle_streak;
+    unsigned long calls;
+    unsigned long busy_ns;
+};
+
+/*
+ * Workers. Each one has a deque of stages to run: it pushes and pops at
+ * tail, thieves take from head. sel and which are scratch space for
+ * park.
+ */
+struct worker {
+    int id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct stage** ring;
+    unsigned int mask;
+    unsigned int head;
+    unsigned int tail;
+    ch_selector* sel;
+    struct stage** which;
+};
+
+static struct stage** stages;
+static int n_stages;
+static struct worker* workers;
+static int n_workers;
+static int started;
+static int stopping;
+static long start_ns;
+
+// the stage ch_pipeline_add connects the next one to
+static struct stage* last_piped;
+
+/*
+ * Idle workers sleep in ch_select on the channels their stages wait for,
+ * plus kick, which wakes them up when something else changed: a stage
+ * dropped below its parallel limit or started holding results. parked
+ * counts them, so that no-one kicks while everybody is busy.
+ */
+static int kick = -1;
+static int parked;
+
+static int n_done;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static __thread int my_id = -1;
+
+static long now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+/*
+ * Deques.
+ */
+
+static void push(struct worker* w, struct stage* s) {
+    pthread_mutex_lock(&w->lock);
+    w->ring[w->tail & w->mask] = s;
+    __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static struct stage* pop(struct worker* w) {
+    struct stage* s = NULL;
+    pthread_mutex_lock(&w->lock);
+    if(w->tail != w->head) {
+        __atomic_store_n(&w->tail, w->tail - 1, __ATOMIC_RELAXED);
+        s = w->ring[w->tail & w->mask];
+    }
+    pthread_mutex_unlock(&w->lock);
+    return s;
+}
+
+static struct stage* steal(struct worker* w) {
+    struct worker* victim;
+    struct stage* s = NULL;
+    int i;
+    for(i = 1; i < n_workers && s == NULL; i++) {
+        victim = &workers[(w->id + i) % n_workers];
+        // peek first, so empty deques cost no lock
+        if(__atomic_load_n(&victim->head, __ATOMIC_RELAXED) ==
+           __atomic_load_n(&victim->tail, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        pthread_mutex_lock(&victim->lock);
+        if(victim->tail != victim->head) {
+            s = victim->ring[victim->head & victim->mask];
+            __atomic_store_n(&victim->head, victim->head + 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return s;
+}
+
+/*
+ * Queues a run of s on w's deque, unless s already has as many runs as
+ * it may have at a time.
+ */
+static void schedule(struct worker* w, struct stage* s) {
+    int tasks = __atomic_load_n(&s->tasks, __ATOMIC_SEQ_CST);
+    do {
+        if(tasks >= __atomic_load_n(&s->parallel, __ATOMIC_RELAXED)) {
+            return;
+        }
+    } while(!__atomic_compare_exchange_n(&s->tasks, &tasks, tasks + 1, 1,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    push(w, s);
+}
+
+/*
+ * Running stages.
+ */
+
+/*
+ * Frees a result that could not be sent, into the output's message pool if
+ * it has one and with free otherwise. Once the output has been released
+ * there is no telling, and a pool would be gone with its messages anyway.
+ */
+static void drop(struct stage* s, void* msg) {
+    int pooled = ch_has_pool(s->out);
+    printf("stage could not send on channel %d, message dropped\n", s->out);
+    if(pooled > 0) {
+        ch_msg_free(msg);
+    } else if(pooled == 0) {
+        free(msg);
+    }
+}
+
+/*
+ * Sends the results held back by earlier runs. Called with s->lock held.
+ * returns 0 once they are all out and 1 if the output is still full.
+ */
+static int flush(struct stage* s) {
+    int err;
+    while(s->n_held > 0) {
+        err = ch_trysend(s->out, s->held[0]);
+        if(err == 0) {
+            return 1;
+        }
+        if(err < 0) {
+            drop(s, s->held[0]);
+        }
+        memmove(s->held, s->held + 1, (s->n_held - 1) * sizeof(void*));
+        __atomic_store_n(&s->n_held, s->n_held - 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/*
+ * Marks s as finished and closes its output, unless another stage that
+ * is still going sends on it too.
+ */
+static void finish(struct stage* s) {
+    int i, shared = 0;
+    pthread_mutex_lock(&done_lock);
+    for(i = 0; i < n_stages; i++) {
+        if(stages[i] != s && stages[i]->out == s->out &&
+           !__atomic_load_n(&stages[i]->done, __ATOMIC_ACQUIRE)) {
+            shared = 1;
+        }
+    }
+    if(s->out != CH_NONE && !shared) {
+        ch_close(s->out);
+    }
+    if(++n_done == n_stages) {
+        pthread_cond_broadcast(&done_cond);
+    }
+    pthread_mutex_unlock(&done_lock);
+}
+
+/*
+ * Samples the input of a CH_STAGE_AUTO stage now and then. A stage that
+ * keeps finding it full falls behind the ones before it and may use one
+ * more worker; one that keeps finding it empty gives one back.
+ */
+static void scale(struct stage* s) {
+    long now = now_ns();
+    long checked = __atomic_load_n(&s->checked, __ATOMIC_ACQUIRE);
+    int depth, capacity, parallel;
+
+    if(now - checked < SCALE_INTERVAL_NS ||
+       !__atomic_compare_exchange_n(&s->checked, &checked, now, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+    depth = ch_depth(s->in);
+    capacity = ch_capacity(s->in);
+    if(depth < 0 || capacity < 0) {
+        return;
+    }
+    if(depth >= capacity) {
+        s->full_streak++;
+        s->idle_streak = 0;
+    } else if(depth == 0) {
+        s->idle_streak++;
+        s->full_streak = 0;
+    } else {
+        s->full_streak = 0;
+        s->idle_streak = 0;
+    }
+
+    parallel = __atomic_load_n(&s->parallel, __ATOMIC_RELAXED);
+    if(s->full_streak >= SCALE_STREAK && parallel < s->max_parallel) {
+        __atomic_store_n(&s->parallel, parallel + 1, __ATOMIC_SEQ_CST);
+        s->full_streak = 0;
+        // a parked worker sees the stage below its limit and joins in
+        if(__atomic_load_n(&parked, __ATOMIC_SEQ_CST) > 0) {
+            ch_trysend(kick, (void*) 1);
+        }
+    } else if(s->idle_streak >= SCALE_STREAK && parallel > 1) {
+        __atomic_store_n(&s->parallel, parallel - 1, __ATOMIC_SEQ_CST);
+        s->idle_streak = 0;
+    }
+}
+
+static void run(struct worker* w, struct stage* s) {
+    void* msg = NULL;
+    void* result;
+    long began;
+    int i, err, held, finished, full = 0, sent = 0;
+
+    pthread_mutex_lock(&s->lock);
+    // queued before the stage finished
+    finished = s->done;
+    if(!finished) {
+        s->running++;
+        full = flush(s);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if(finished) {
+        __atomic_sub_fetch(&s->tasks, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    began = now_ns();
+    for(i = 0; !full && !__atomic_load_n(&s->drained, __ATOMIC_ACQUIRE) && i < STAGE_BATCH; i++) {
+        if(s->in != CH_NONE) {
+            err = ch_tryrecv(s->in, &msg);
+            if(err == 0) {
+                break;
+            }
+            if(err < 0) {
+                // closed and drained
+                __atomic_store_n(&s->drained, 1, __ATOMIC_RELEASE);
+                break;
+            }
+        }
+        __atomic_add_fetch(&s->calls, 1, __ATOMIC_RELAXED);
+        result = s->fn(msg, s->ctx);
+        if(result == NULL) {
+            if(s->in == CH_NONE) {
+                __atomic_store_n(&s->drained, 1, __ATOMIC_RELEASE);
+            }
+            continue;
+        }
+        if(s->out == CH_NONE) {
+            continue;
+        }
+        err = ch_trysend(s->out, result);
+        if(err == 1) {
+            sent++;
+        } else if(err == 0) {
+            // another run filled the output meanwhile
+            pthread_mutex_lock(&s->lock);
+            s->held[s->n_held] = result;
+            __atomic_store_n(&s->n_held, s->n_held + 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&s->lock);
+            full = 1;
+        } else {
+            drop(s, result);
+        }
+    }
+    __atomic_add_fetch(&s->busy_ns, now_ns() - began, __ATOMIC_RELAXED);
+
+    // run the next stage while the messages are still in our cache
+    if(sent > 0 && s->next != NULL) {
+        schedule(w, s->next);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->running--;
+    held = s->n_held;
+    finished = __atomic_load_n(&s->drained, __ATOMIC_ACQUIRE) && s->running == 0 &&
+               held == 0 && !s->done;
+    if(finished) {
+        __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if(finished) {
+        finish(s);
+    } else if(s->auto_scale && s->in != CH_NONE) {
+        scale(s);
+    }
+
+    if(__atomic_fetch_sub(&s->tasks, 1, __ATOMIC_SEQ_CST) >=
+       __atomic_load_n(&s->parallel, __ATOMIC_SEQ_CST) || held > 0) {
+        if(__atomic_load_n(&parked, __ATOMIC_SEQ_CST) > 0) {
+            ch_trysend(kick, (void*) 1);
+        }
+    }
+    if(i == STAGE_BATCH && !finished) {
+        schedule(w, s);
+    }
+}
+
+/*
+ * Sleeps until one of the stages that may be run some more can make
+ * progress, and queues those that can.
+ */
+static void drop_kicks() {
+    void* msg;
+    while(ch_tryrecv(kick, &msg) == 1) {
+    }
+}
+
+static void park(struct worker* w) {
+    struct stage* s;
+    int i, n = 0;
+
+    __atomic_add_fetch(&parked, 1, __ATOMIC_SEQ_CST);
+    for(i = 0; i < n_stages; i++) {
+        s = stages[i];
+        if(__atomic_load_n(&s->done, __ATOMIC_ACQUIRE) ||
+           __atomic_load_n(&s->tasks, __ATOMIC_SEQ_CST) >=
+           __atomic_load_n(&s->parallel, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+        if(__atomic_load_n(&s->n_held, __ATOMIC_RELAXED) > 0) {
+            w->sel[n].channel = s->out;
+            w->sel[n].events = CH_SELECT_SEND;
+        } else if(__atomic_load_n(&s->drained, __ATOMIC_ACQUIRE)) {
+            continue;
+        } else if(s->in == CH_NONE) {
+            w->sel[n].channel = s->out;
+            w->sel[n].events = CH_SELECT_SEND;
+        } else {
+            w->sel[n].channel = s->in;
+            w->sel[n].events = CH_SELECT_RECV;
+        }
+        w->which[n++] = s;
+    }
+    w->sel[n].channel = kick;
+    w->sel[n].events = CH_SELECT_RECV;
+
+    if(!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE) && ch_select(w->sel, n + 1, -1) > 0) {
+        drop_kicks();
+        for(i = 0; i < n; i++) {
+            if(w->sel[i].revents) {
+                schedule(w, w->which[i]);
+            }
+        }
+    }
+    __atomic_sub_fetch(&parked, 1, __ATOMIC_SEQ_CST);
+}
+
+static void* work(void* param) {
+    struct worker* w = param;
+    struct stage* s;
+    my_id = w->id;
+    while(!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        s = pop(w);
+        if(s == NULL) {
+            s = steal(w);
+        }
+        if(s != NULL) {
+            run(w, s);
+        } else {
+            park(w);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Set up and tear down.
+ */
+
+static int add_stage(int in, int out, int parallel, ch_stage_fn fn, void* ctx) {
+    struct stage** grown;
+    struct stage* s;
+    int i;
+    if(started) {
+        printf("stages cannot be added while the workers run\n");
+        return -1;
+    }
+    if(fn == NULL || parallel < CH_STAGE_AUTO || (in != CH_NONE && in == out)) {
+        printf("invalid stage\n");
+        return -1;
+    }
+    for(i = 0; i < n_stages; i++) {
+        if(in != CH_NONE && stages[i]->in == in) {
+            printf("channel %d is the input of stage %d already\n", in, i);
+            return -1;
+        }
+    }
+    grown = realloc(stages, (n_stages + 1) * sizeof(struct stage*));
+    if(grown == NULL) {
+        printf("error allocating stage\n");
+        return -1;
+    }
+    stages = grown;
+    s = calloc(1, sizeof(struct stage));
+    if(s == NULL) {
+        printf("error allocating stage\n");
+        return -1;
+    }
+    s->in = in;
+    s->out = out;
+    s->parallel = parallel;
+    s->auto_scale = parallel == CH_STAGE_AUTO;
+    s->fn = fn;
+    s->ctx = ctx;
+    pthread_mutex_init(&s->lock, NULL);
+    stages[n_stages] = s;
+    return n_stages++;
+}
+
+int ch_stage_add(int in, int out, int parallel, ch_stage_fn fn, void* ctx) {
+    if(in == CH_NONE && out == CH_NONE) {
+        printf("invalid stage\n");
+        return -1;
+    }
+    return add_stage(in, out, parallel, fn, ctx);
+}
+
+int ch_pipeline_add(ch_stage_fn fn, void* ctx, int parallel, int capacity) {
+    ch_attr attr;
+    int in = CH_NONE, stage;
+
+    if(started) {
+        printf("stages cannot be added while the workers run\n");
+        return -1;
+    }
+    // stages only ever try to send and receive, and two of those never
+    // meet on a rendezvous channel
+    if(last_piped != NULL && capacity < 1) {
+        printf("a pipeline channel needs a capacity of at least 1\n");
+        return -1;
+    }
+    if(last_piped != NULL) {
+        ch_attr_init(&attr);
+        attr.capacity = capacity;
+        // lock-free if it can be, since any number of workers may use it
+        if(capacity >= 2) {
+            attr.mode = CH_MODE_MPMC;
+        }
+        in = ch_open(CH_NEW, &attr);
+        if(in < 0) {
+            return -1;
+        }
+    }
+    stage = add_stage(in, CH_NONE, parallel, fn, ctx);
+    if(stage < 0) {
+        if(in != CH_NONE) {
+            ch_release(in);
+        }
+        return -1;
+    }
+    if(last_piped != NULL) {
+        last_piped->out = in;
+    }
+    stages[stage]->own_in = in != CH_NONE;
+    last_piped = stages[stage];
+    return stage;
+}
+
+int ch_stage_stats(int stage, ch_stage_metrics* out) {
+    struct stage* s;
+    long elapsed;
+    if(out == NULL) {
+        printf("invalid stage stats buffer\n");
+        return -1;
+    }
+    pthread_mutex_lock(&done_lock);
+    if(!started || stage < 0 || stage >= n_stages) {
+        pthread_mutex_unlock(&done_lock);
+        printf("no stage %d is running\n", stage);
+        return -1;
+    }
+    s = stages[stage];
+    elapsed = now_ns() - start_ns;
+    out->calls = __atomic_load_n(&s->calls, __ATOMIC_RELAXED);
+    out->busy_ns = __atomic_load_n(&s->busy_ns, __ATOMIC_RELAXED);
+    out->elapsed_ns = elapsed > 0 ? elapsed : 1;
+    out->parallel = __atomic_load_n(&s->parallel, __ATOMIC_RELAXED);
+    out->utilization = (double) out->busy_ns / out->elapsed_ns / out->parallel;
+    if(out->utilization > 1) {
+        out->utilization = 1;
+    }
+    out->depth = 0;
+    out->capacity = 0;
+    if(s->in != CH_NONE) {
+        out->depth = ch_depth(s->in);
+        out->capacity = ch_capacity(s->in);
+    }
+    pthread_mutex_unlock(&done_lock);
+    return 0;
+}
+
+static void free_stages() {
+    int i;
+    for(i = 0; i < n_stages; i++) {
+        // closed and drained by now
+        if(stages[i]->own_in) {
+            ch_release(stages[i]->in);
+        }
+        pthread_mutex_destroy(&stages[i]->lock);
+        free(stages[i]->held);
+        free(stages[i]);
+    }
+    free(stages);
+    stages = NULL;
+    n_stages = 0;
+    last_piped = NULL;
+}
+
+static void free_workers() {
+    int i;
+    for(i = 0; i < n_workers; i++) {
+        pthread_mutex_destroy(&workers[i].lock);
+        free(workers[i].ring);
+        free(workers[i].sel);
+        free(workers[i].which);
+    }
+    free(workers);
+    workers = NULL;
+    n_workers = 0;
+}
+
+int ch_workers_start(int n) {
+    struct stage* s;
+    unsigned int size = 1;
+    int i, j, total = 0;
+
+    if(started) {
+        printf("the workers are running already\n");
+        return -1;
+    }
+    if(n_stages == 0 || n < 0) {
+        printf("nothing for the workers to do\n");
+        return -1;
+    }
+    if(n == 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        if(n < 1) {
+            n = 1;
+        }
+    }
+
+    for(i = 0; i < n_stages; i++) {
+        s = stages[i];
+        if(s->auto_scale) {
+            // grows from one worker as far as the input backs up
+            s->parallel = 1;
+            s->max_parallel = n;
+        } else {
+            if(s->parallel == 0 || s->parallel > n) {
+                s->parallel = n;
+            }
+            s->max_parallel = s->parallel;
+        }
+        s->checked = 0;
+        s->full_streak = 0;
+        s->idle_streak = 0;
+        s->calls = 0;
+        s->busy_ns = 0;
+        free(s->held);
+        s->held = calloc(s->max_parallel, sizeof(void*));
+        if(s->held == NULL) {
+            printf("error allocating stage\n");
+            return -1;
+        }
+        s->next = NULL;
+        for(j = 0; j < n_stages; j++) {
+            if(s->out != CH_NONE && stages[j]->in == s->out) {
+                s->next = stages[j];
+            }
+        }
+        total += s->max_parallel;
+    }
+    // every queued run counts towards a stage's parallel limit, so no
+    // deque ever holds more than total
+    while(size < total) {
+        size <<= 1;
+    }
+
+    kick = ch_open(CH_NEW, NULL);
+    if(kick < 0) {
+        return -1;
+    }
+    workers = calloc(n, sizeof(struct worker));
+    if(workers == NULL) {
+        printf("error allocating workers\n");
+        ch_release(kick);
+        return -1;
+    }
+    n_workers = n;
+    for(i = 0; i < n; i++) {
+        workers[i].id = i;
+        workers[i].mask = size - 1;
+        workers[i].ring = calloc(size, sizeof(struct stage*));
+        workers[i].sel = calloc(n_stages + 1, sizeof(ch_selector));
+        workers[i].which = calloc(n_stages, sizeof(struct stage*));
+        pthread_mutex_init(&workers[i].lock, NULL);
+        if(workers[i].ring == NULL || workers[i].sel == NULL || workers[i].which == NULL) {
+            printf("error allocating workers\n");
+            free_workers();
+            ch_release(kick);
+            return -1;
+        }
+    }
+
+    // give every stage a first run; the ones without input yet go idle
+    for(i = 0; i < n_stages; i++) {
+        schedule(&workers[i % n], stages[i]);
+    }
+    n_done = 0;
+    stopping = 0;
+    parked = 0;
+    start_ns = now_ns();
+    started = 1;
+    for(i = 0; i < n; i++) {
+        if(pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            printf("error starting worker %d\n", i);
+            // the ones already running stop again
+            __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+            ch_close(kick);
+            for(j = 0; j < i; j++) {
+                pthread_join(workers[j].thread, NULL);
+            }
+            free_workers();
+            drop_kicks();
+            ch_release(kick);
+            started = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int ch_workers_wait() {
+    int i;
+    if(!started) {
+        printf("the workers are not running\n");
+        return -1;
+    }
+    pthread_mutex_lock(&done_lock);
+    while(n_done < n_stages) {
+        pthread_cond_wait(&done_cond, &done_lock);
+    }
+    pthread_mutex_unlock(&done_lock);
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    ch_close(kick);
+    for(i = 0; i < n_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free_workers();
+    drop_kicks();
+    ch_release(kick);
+    kick = -1;
+    // under done_lock, so that ch_stage_stats does not look at them meanwhile
+    pthread_mutex_lock(&done_lock);
+    free_stages();
+    started = 0;
+    pthread_mutex_unlock(&done_lock);
+    return 0;
+}
+
+int ch_worker_id() {
+    return my_id;
+}
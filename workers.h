@@ -0,0 +1,132 @@
+/* Stage scheduler.
+
+   Runs a pipeline of stages connected by channels on a fixed pool of
+   worker threads, instead of giving every stage threads of its own. A
+   stage is a callback that turns a message from its input channel into
+   a message for its output channel. Whenever a stage has input and its
+   output has room, any idle worker may run it, so the workers follow the
+   bottleneck of the pipeline wherever it is.
+
+   Each worker keeps a deque of stages to run. After a stage has passed
+   messages on, the worker queues the stage that reads them next and runs
+   it right away, while the messages are still in its cache; workers that
+   run out of stages steal the oldest ones queued by other workers, and
+   only sleep, in ch_select, once no stage can make progress.
+
+   A stage finishes once its input has been closed and drained, and then
+   closes its output, so closing the input of the first stage shuts the
+   whole pipeline down.
+
+   Pipelines that run straight from one stage to the next are easiest
+   declared with ch_pipeline_add, which opens the channels in between.
+   A stage added with CH_STAGE_AUTO finds its own number of workers: it
+   gets one more whenever its input has stayed full for a while, and
+   gives one back whenever it has stayed empty, so the workers settle on
+   the stages that hold the pipeline up. ch_stage_stats tells how busy
+   each stage is and how full its input.
+*/
+
+/*
+ * Pass as the input of a stage that produces messages itself, or as the
+ * output of a stage that consumes them.
+ */
+#define CH_NONE (-1)
+
+/*
+ * Pass as the parallel of a stage to have the workers adjust it while
+ * they run, from 1 up to the number of workers, by how full the stage's
+ * input stays. A stage without an input stays at 1.
+ */
+#define CH_STAGE_AUTO (-1)
+
+/*
+ * A stage's callback.
+ * msg = the message taken from the stage's input, or NULL for a stage
+ * without one.
+ * ctx = the ctx given to ch_stage_add.
+ * returns the message to send on the stage's output, or NULL to send
+ * nothing. A stage without an input returns NULL once it has nothing
+ * more to produce, which finishes it. A message that cannot be sent, e.g.
+ * because the output was closed, is freed with ch_msg_free if the output
+ * has a message pool and with free otherwise.
+ */
+typedef void* (*ch_stage_fn)(void* msg, void* ctx);
+
+/*
+ * Adds a stage to the pipeline run by ch_workers_start.
+ * in = the channel the stage receives from, or CH_NONE. A channel can be
+ * the input of at most one stage.
+ * out = the channel the stage sends on, or CH_NONE.
+ * parallel = how many workers may run the stage at the same time, 0
+ * for as many as there are, or CH_STAGE_AUTO. Messages passing through a
+ * stage that more than one worker runs at a time may be reordered.
+ * returns the number of the stage on success and < 0 on error.
+ *
+ * Preconditions: the workers are not running, and in and out are open
+ * pointer channels.
+ */
+int ch_stage_add(int in, int out, int parallel, ch_stage_fn fn, void* ctx);
+
+/*
+ * Adds a stage at the end of a linear pipeline. The first stage added
+ * this way has no input and produces the messages; every later one
+ * receives what the one added before it sends, through a channel that is
+ * opened here and released by ch_workers_wait. The last one has no
+ * output.
+ * parallel = as for ch_stage_add.
+ * capacity = the capacity of the channel into the stage, a power of two.
+ * Ignored for the first stage.
+ * returns the number of the stage on success and < 0 on error.
+ *
+ * Preconditions: the workers are not running.
+ */
+int ch_pipeline_add(ch_stage_fn fn, void* ctx, int parallel, int capacity);
+
+/*
+ * Starts the workers, which run the stages added so far until every one
+ * of them has finished.
+ * workers = how many worker threads to start, or 0 for one per CPU.
+ * returns 0 on success and < 0 on error.
+ */
+int ch_workers_start(int workers);
+
+/*
+ * Waits until every stage has finished, then stops the workers and
+ * removes the stages, so that a new pipeline can be set up.
+ * returns 0 on success and < 0 on error.
+ */
+int ch_workers_wait();
+
+/*
+ * Statistics of a stage since the workers started, filled in by
+ * ch_stage_stats.
+ * calls = how often the stage's callback was called.
+ * busy_ns = the total time workers spent running the stage.
+ * elapsed_ns = the time since the workers started.
+ * parallel = how many workers may run the stage at a time right now.
+ * utilization = busy_ns / (elapsed_ns * parallel), the share of the
+ * workers it may use that the stage kept busy.
+ * depth, capacity = how many messages wait in the stage's input and how
+ * many it can hold; both 0 for a stage without input.
+ */
+typedef struct {
+    unsigned long calls;
+    unsigned long busy_ns;
+    unsigned long elapsed_ns;
+    int parallel;
+    double utilization;
+    int depth;
+    int capacity;
+} ch_stage_metrics;
+
+/*
+ * Takes a snapshot of a stage's statistics while the workers run.
+ * returns 0 on success and < 0 on error.
+ */
+int ch_stage_stats(int stage, ch_stage_metrics* out);
+
+/*
+ * returns the number of the worker running the calling thread, from 0,
+ * or -1 if it is not a worker.
+ */
+int ch_worker_id();